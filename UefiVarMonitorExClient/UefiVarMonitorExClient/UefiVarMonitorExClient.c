@@ -1,265 +1,447 @@
-#include <UefiVarMonitorExDxe.h>
-#include <ntstrsafe.h>
-#include <intrin.h>
-
-/**
- * @brief Handles GetVariable and SetVariable runtime service calls.
- */
-static
-BOOLEAN
-EFIAPI
-HandleGetOrSetVariable (
-    _Inout_ VARIABLE_CALLBACK_PARAMETERS* Parameters
-    )
-{
-    NTSTATUS status;
-    CHAR guidStr[RTL_GUID_STRING_SIZE - 2 + 1];  // -2 for {}, +1 for NULL
-    CONST GUID* guid;
-    SIZE_T dataSize;
-    CONST WCHAR* variableName;
-    CONST CHAR* message;
-
-    //
-    // This callback is always called at DISPATCH_LEVEL (to prevent recursive call).
-    //
-    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
-
-    //
-    // This sample does not do anything with the pre-callback.
-    //
-    if (Parameters->OperationType == OperationPre)
-    {
-        goto Exit;
-    }
-
-    //
-    // Gather parameters and results to print them out.
-    //
-    if (Parameters->CallbackType == VariableCallbackGet)
-    {
-        guid = *Parameters->Parameters.Get.VendorGuid;
-        dataSize = **Parameters->Parameters.Get.DataSize;
-        variableName = *Parameters->Parameters.Get.VariableName;
-        message = Parameters->Parameters.Get.StatusMessage;
-    }
-    else
-    {
-        guid = *Parameters->Parameters.Set.VendorGuid;
-        dataSize = *Parameters->Parameters.Set.DataSize;
-        variableName = *Parameters->Parameters.Set.VariableName;
-        message = Parameters->Parameters.Set.StatusMessage;
-    }
-
-    status = RtlStringCchPrintfA(
-        guidStr,
-        RTL_NUMBER_OF(guidStr),
-        "%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-        guid->Data1,
-        guid->Data2,
-        guid->Data3,
-        guid->Data4[0],
-        guid->Data4[1],
-        guid->Data4[2],
-        guid->Data4[3],
-        guid->Data4[4],
-        guid->Data4[5],
-        guid->Data4[6],
-        guid->Data4[7]);
-    NT_VERIFY(NT_SUCCESS(status));
-
-    DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-               DPFLTR_ERROR_LEVEL,
-               "%c: %s Size=%08X %S: %s\n",
-               (Parameters->CallbackType == VariableCallbackGet) ? 'G' : 'S',
-               guidStr,
-               dataSize,
-               variableName,
-               message);
-
-Exit:
-    //
-    // This callback always allows the original function to be called (returns FALSE) .
-    //
-    return FALSE;
-}
-
-/**
- * @brief Prints out log entries by parsing log buffer.
- */
-static
-VOID
-ProcessBuffer (
-    _In_ CONST UINT8* Buffer,
-    _In_ ULONG EndOffset
-    )
-{
-    PAGED_CODE();
-
-    for (ULONG offset = 0; offset < EndOffset; )
-    {
-        NTSTATUS status;
-        CONST VARIABLE_LOG_ENTRY* entry;
-        CHAR guidStr[RTL_GUID_STRING_SIZE - 2 + 1];  // -2 for {}, +1 for NULL
-
-        entry = (CONST VARIABLE_LOG_ENTRY*)&Buffer[offset];
-
-        status = RtlStringCchPrintfA(
-            guidStr,
-            RTL_NUMBER_OF(guidStr),
-            "%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
-            entry->VendorGuid.Data1,
-            entry->VendorGuid.Data2,
-            entry->VendorGuid.Data3,
-            entry->VendorGuid.Data4[0],
-            entry->VendorGuid.Data4[1],
-            entry->VendorGuid.Data4[2],
-            entry->VendorGuid.Data4[3],
-            entry->VendorGuid.Data4[4],
-            entry->VendorGuid.Data4[5],
-            entry->VendorGuid.Data4[6],
-            entry->VendorGuid.Data4[7]);
-        NT_VERIFY(NT_SUCCESS(status));
-
-        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "%c: %s Size=%08X %S: %s\n",
-                   (entry->CallbackType == VariableCallbackGet) ? 'G' : 'S',
-                   guidStr,
-                   entry->DataSize,
-                   entry->VariableName,
-                   entry->StatusMessage);
-
-        offset += ALIGN_UP_BY(sizeof(*entry) + entry->DataSize, 0x10);
-    }
-}
-
-/**
- * @brief Unloading entry point. Unregisters the registered callback.
- */
-static
-VOID
-DriverUnload (
-    _In_ PDRIVER_OBJECT DriverObject
-    )
-{
-    NTSTATUS status;
-    VOID* data;
-    ULONG size;
-    UNICODE_STRING unregisterCallbacks = RTL_CONSTANT_STRING(L"UnregisterCallbacks");
-
-    UNREFERENCED_PARAMETER(DriverObject);
-
-    PAGED_CODE();
-
-    //
-    // Unregister the callback.
-    //
-    data = (VOID*)&HandleGetOrSetVariable;
-    size = sizeof(data);
-    status = ExGetFirmwareEnvironmentVariable(&unregisterCallbacks,
-                                              (GUID*)&g_BackdoorGuid,
-                                              &data,
-                                              &size,
-                                              NULL);
-    NT_ASSERT(NT_SUCCESS(status));
-}
-
-/**
- * @brief The module entry point. Prints out all buffered logs and registers a callback.
- */
-NTSTATUS
-DriverEntry (
-    _In_ PDRIVER_OBJECT DriverObject,
-    _In_ PUNICODE_STRING RegistryPath
-    )
-{
-    NTSTATUS status;
-    ULONG size;
-    VOID* data;
-    UINT8* buffer;
-    UNICODE_STRING drainBuffer = RTL_CONSTANT_STRING(L"DrainBuffer");
-    UNICODE_STRING registerCallbacks = RTL_CONSTANT_STRING(L"RegisterCallbacks");
-
-    UNREFERENCED_PARAMETER(RegistryPath);
-
-    buffer = NULL;
-
-    DriverObject->DriverUnload = DriverUnload;
-
-    //
-    // Get a size of buffer required to drain contents of saved logs.
-    //
-    size = 0;
-    status = ExGetFirmwareEnvironmentVariable(&drainBuffer,
-                                              (GUID*)&g_BackdoorGuid,
-                                              NULL,
-                                              &size,
-                                              NULL);
-    if (status != STATUS_BUFFER_TOO_SMALL)
-    {
-        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "ExGetFirmwareEnvironmentVariable returned unexpected value: %08x\n",
-                   status);
-        status = STATUS_UNSUCCESSFUL;
-        goto Exit;
-    }
-
-    //
-    // Allocate the buffer, get the contents, and parse it if there is any log.
-    //
-    if (size != 0)
-    {
-        buffer = ExAllocatePoolWithTag(PagedPool, size, 'CMVU');
-        if (buffer == NULL)
-        {
-            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                       DPFLTR_ERROR_LEVEL,
-                       "ExAllocatePoolWithTag failed : %08x\n", size);
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto Exit;
-        }
-
-        status = ExGetFirmwareEnvironmentVariable(&drainBuffer,
-                                                  (GUID*)&g_BackdoorGuid,
-                                                  buffer,
-                                                  &size,
-                                                  NULL);
-        if (!NT_SUCCESS(status))
-        {
-            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                       DPFLTR_ERROR_LEVEL,
-                       "ExGetFirmwareEnvironmentVariable(DrainBuffer) failed : %08x\n",
-                       status);
-            goto Exit;
-        }
-
-        ProcessBuffer(buffer, size);
-    }
-
-    //
-    // Register the callback.
-    //
-    data = (VOID*)&HandleGetOrSetVariable;
-    size = sizeof(data);
-    status = ExGetFirmwareEnvironmentVariable(&registerCallbacks,
-                                              (GUID*)&g_BackdoorGuid,
-                                              &data,
-                                              &size,
-                                              NULL);
-    if (!NT_SUCCESS(status))
-    {
-        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
-                   DPFLTR_ERROR_LEVEL,
-                   "ExGetFirmwareEnvironmentVariable(RegisterCallbacks) failed : %08x\n",
-                   status);
-        goto Exit;
-    }
-
-Exit:
-    if (buffer != NULL)
-    {
-        ExFreePoolWithTag(buffer, 'CMVU');
-    }
-    return status;
-}
+#include <UefiVarMonitorExDxe.h>
+#include <ntstrsafe.h>
+#include <intrin.h>
+
+/**
+ * @brief Handles GetVariable and SetVariable runtime service calls.
+ */
+static
+BOOLEAN
+EFIAPI
+HandleGetOrSetVariable (
+    _Inout_ VARIABLE_CALLBACK_PARAMETERS* Parameters
+    )
+{
+    NTSTATUS status;
+    CHAR guidStr[RTL_GUID_STRING_SIZE - 2 + 1];  // -2 for {}, +1 for NULL
+    CONST GUID* guid;
+    SIZE_T dataSize;
+    CONST WCHAR* variableName;
+    CONST CHAR* message;
+
+    //
+    // This callback is always called at DISPATCH_LEVEL (to prevent recursive call).
+    //
+    NT_ASSERT(KeGetCurrentIrql() == DISPATCH_LEVEL);
+
+    //
+    // This sample subscribes only the post-callback.
+    //
+    NT_ASSERT(Parameters->OperationType == OperationPost);
+
+    //
+    // Gather parameters and results to print them out.
+    //
+    if (Parameters->CallbackType == VariableCallbackGet)
+    {
+        guid = *Parameters->Parameters.Get.VendorGuid;
+        dataSize = **Parameters->Parameters.Get.DataSize;
+        variableName = *Parameters->Parameters.Get.VariableName;
+        message = GetStatusMessage(Parameters->Parameters.Get.Status);
+    }
+    else
+    {
+        guid = *Parameters->Parameters.Set.VendorGuid;
+        dataSize = *Parameters->Parameters.Set.DataSize;
+        variableName = *Parameters->Parameters.Set.VariableName;
+        message = GetStatusMessage(Parameters->Parameters.Set.Status);
+    }
+
+    status = RtlStringCchPrintfA(
+        guidStr,
+        RTL_NUMBER_OF(guidStr),
+        "%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
+        guid->Data1,
+        guid->Data2,
+        guid->Data3,
+        guid->Data4[0],
+        guid->Data4[1],
+        guid->Data4[2],
+        guid->Data4[3],
+        guid->Data4[4],
+        guid->Data4[5],
+        guid->Data4[6],
+        guid->Data4[7]);
+    NT_VERIFY(NT_SUCCESS(status));
+
+    DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+               DPFLTR_ERROR_LEVEL,
+               "%c: %s Size=%08X %S: %s\n",
+               (Parameters->CallbackType == VariableCallbackGet) ? 'G' : 'S',
+               guidStr,
+               dataSize,
+               variableName,
+               message);
+
+    //
+    // This callback always allows the original function to be called (returns FALSE) .
+    //
+    return FALSE;
+}
+
+/**
+ * @brief Prints out log entries by parsing log buffer.
+ */
+static
+VOID
+ProcessBuffer (
+    _In_ CONST UINT8* Buffer,
+    _In_ ULONG EndOffset,
+    _In_reads_(NameCount) CONST VARIABLE_NAME_RECORD* Names,
+    _In_ ULONG NameCount,
+    _In_ CONST LOG_BUFFER_HEADER* Header
+    )
+{
+    static CONST VARIABLE_NAME_RECORD unknownName = { VARIABLE_ID_UNKNOWN, 0, { 0 }, L"(Unknown)" };
+
+    PAGED_CODE();
+
+    for (ULONG offset = 0; offset < EndOffset; )
+    {
+        NTSTATUS status;
+        CONST VARIABLE_LOG_ENTRY* entry;
+        CONST VARIABLE_NAME_RECORD* name;
+        UINT64 elapsed;
+        CHAR guidStr[RTL_GUID_STRING_SIZE - 2 + 1];  // -2 for {}, +1 for NULL
+
+        entry = (CONST VARIABLE_LOG_ENTRY*)&Buffer[offset];
+
+        //
+        // IDs are assigned from 1 in order, and hence, index the names.
+        //
+        if ((entry->VariableId != VARIABLE_ID_UNKNOWN) && (entry->VariableId <= NameCount))
+        {
+            name = &Names[entry->VariableId - 1];
+        }
+        else
+        {
+            name = &unknownName;
+        }
+
+        status = RtlStringCchPrintfA(
+            guidStr,
+            RTL_NUMBER_OF(guidStr),
+            "%08lX-%04hX-%04hX-%02hhX%02hhX-%02hhX%02hhX%02hhX%02hhX%02hhX%02hhX",
+            name->VendorGuid.Data1,
+            name->VendorGuid.Data2,
+            name->VendorGuid.Data3,
+            name->VendorGuid.Data4[0],
+            name->VendorGuid.Data4[1],
+            name->VendorGuid.Data4[2],
+            name->VendorGuid.Data4[3],
+            name->VendorGuid.Data4[4],
+            name->VendorGuid.Data4[5],
+            name->VendorGuid.Data4[6],
+            name->VendorGuid.Data4[7]);
+        NT_VERIFY(NT_SUCCESS(status));
+
+        //
+        // Convert the time spent in the original service into microseconds if
+        // the frequency is known.
+        //
+        elapsed = entry->TscEnd - entry->TscStart;
+        if (Header->TscFrequency != 0)
+        {
+            elapsed = elapsed * 1000000 / Header->TscFrequency;
+        }
+
+        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                   DPFLTR_ERROR_LEVEL,
+                   "%llu CPU%u %c: %s Size=%08X %S: %s (%llu%s) Suppressed=%u\n",
+                   entry->SequenceNumber,
+                   entry->ApicId,
+                   (entry->CallbackType < VARIABLE_SERVICE_COUNT) ?
+                       VARIABLE_CALLBACK_TYPE_LETTERS[entry->CallbackType] : '?',
+                   guidStr,
+                   entry->DataSize,
+                   name->VariableName,
+                   GetStatusMessage((EFI_STATUS)entry->Status),
+                   elapsed,
+                   (Header->TscFrequency != 0) ? "us" : " ticks",
+                   entry->SuppressedEntries);
+
+        offset += entry->EntrySize;
+    }
+}
+
+/**
+ * @brief Fetches the names of variables registered after the given count.
+ */
+static
+NTSTATUS
+UpdateVariableNames (
+    _Inout_updates_(MAX_VARIABLE_NAMES) VARIABLE_NAME_RECORD* Names,
+    _Inout_ ULONG* NameCount
+    )
+{
+    NTSTATUS status;
+    ULONG size;
+    ULONG entryCount;
+    GET_VARIABLE_NAMES_HEADER* header;
+    UNICODE_STRING getVariableNames = RTL_CONSTANT_STRING(L"GetVariableNames");
+
+    PAGED_CODE();
+
+    header = ExAllocatePoolWithTag(PagedPool, PAGE_SIZE, 'CMVU');
+    if (header == NULL)
+    {
+        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                   DPFLTR_ERROR_LEVEL,
+                   "ExAllocatePoolWithTag failed : %08x\n", PAGE_SIZE);
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    do
+    {
+        RtlZeroMemory(header, sizeof(*header));
+        header->Cursor = *NameCount + 1;
+        size = PAGE_SIZE;
+        status = ExGetFirmwareEnvironmentVariable(&getVariableNames,
+                                                  (GUID*)&g_BackdoorGuid,
+                                                  header,
+                                                  &size,
+                                                  NULL);
+        if (!NT_SUCCESS(status))
+        {
+            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                       DPFLTR_ERROR_LEVEL,
+                       "ExGetFirmwareEnvironmentVariable(GetVariableNames) failed : %08x\n",
+                       status);
+            goto Exit;
+        }
+
+        entryCount = min(header->EntryCount, MAX_VARIABLE_NAMES - *NameCount);
+        RtlCopyMemory(&Names[*NameCount], header + 1, entryCount * sizeof(*Names));
+        *NameCount += entryCount;
+    } while ((header->Flags & GET_VARIABLE_NAMES_FLAG_MORE_ENTRIES) != 0);
+
+Exit:
+    if (header != NULL)
+    {
+        ExFreePoolWithTag(header, 'CMVU');
+    }
+    return status;
+}
+
+/**
+ * @brief Drains saved logs incrementally and prints them out.
+ *
+ * @details The buffer starts small and grows only when a single log entry does
+ *      not fit in it.
+ */
+static
+NTSTATUS
+DrainLogs (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG size;
+    ULONG bufferSize;
+    UINT64 cursor;
+    DRAIN_BUFFER_EX_HEADER* header;
+    VARIABLE_NAME_RECORD* names;
+    ULONG nameCount;
+    UNICODE_STRING drainBufferEx = RTL_CONSTANT_STRING(L"DrainBufferEx");
+
+    PAGED_CODE();
+
+    header = NULL;
+    bufferSize = PAGE_SIZE;
+    cursor = 0;
+    nameCount = 0;
+
+    names = ExAllocatePoolWithTag(PagedPool,
+                                  MAX_VARIABLE_NAMES * sizeof(*names),
+                                  'CMVU');
+    if (names == NULL)
+    {
+        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                   DPFLTR_ERROR_LEVEL,
+                   "ExAllocatePoolWithTag failed : %08x\n",
+                   MAX_VARIABLE_NAMES * sizeof(*names));
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    for (;;)
+    {
+        if (header == NULL)
+        {
+            header = ExAllocatePoolWithTag(PagedPool, bufferSize, 'CMVU');
+            if (header == NULL)
+            {
+                DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                           DPFLTR_ERROR_LEVEL,
+                           "ExAllocatePoolWithTag failed : %08x\n", bufferSize);
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto Exit;
+            }
+        }
+
+        RtlZeroMemory(header, sizeof(*header));
+        header->Cursor = cursor;
+        size = bufferSize;
+        status = ExGetFirmwareEnvironmentVariable(&drainBufferEx,
+                                                  (GUID*)&g_BackdoorGuid,
+                                                  header,
+                                                  &size,
+                                                  NULL);
+        if (status == STATUS_BUFFER_TOO_SMALL)
+        {
+            //
+            // The next entry is larger than the buffer. Retry with the bigger one.
+            //
+            ExFreePoolWithTag(header, 'CMVU');
+            header = NULL;
+            bufferSize = size;
+            continue;
+        }
+        if (!NT_SUCCESS(status))
+        {
+            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                       DPFLTR_ERROR_LEVEL,
+                       "ExGetFirmwareEnvironmentVariable(DrainBufferEx) failed : %08x\n",
+                       status);
+            goto Exit;
+        }
+
+        if ((header->Log.Signature != LOG_BUFFER_SIGNATURE) ||
+            (header->Log.Version != LOG_BUFFER_VERSION))
+        {
+            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                       DPFLTR_ERROR_LEVEL,
+                       "Unsupported log buffer format : %08x v%u\n",
+                       header->Log.Signature,
+                       header->Log.Version);
+            status = STATUS_NOT_SUPPORTED;
+            goto Exit;
+        }
+
+        if (header->LostEntries != 0)
+        {
+            DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                       DPFLTR_ERROR_LEVEL,
+                       "%llu entries were lost\n",
+                       header->LostEntries);
+        }
+
+        //
+        // Fetch the names of variables first logged since the last fetch. The
+        // names of the drained entries were registered before they were logged.
+        //
+        status = UpdateVariableNames(names, &nameCount);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        ProcessBuffer((CONST UINT8*)(header + 1),
+                      size - (ULONG)sizeof(*header),
+                      names,
+                      nameCount,
+                      &header->Log);
+
+        cursor = header->Cursor;
+        if ((header->Flags & DRAIN_BUFFER_EX_FLAG_MORE_ENTRIES) == 0)
+        {
+            break;
+        }
+    }
+
+Exit:
+    if (names != NULL)
+    {
+        ExFreePoolWithTag(names, 'CMVU');
+    }
+    if (header != NULL)
+    {
+        ExFreePoolWithTag(header, 'CMVU');
+    }
+    return status;
+}
+
+/**
+ * @brief Unloading entry point. Unregisters the registered callback.
+ */
+static
+VOID
+DriverUnload (
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    NTSTATUS status;
+    VOID* data;
+    ULONG size;
+    UNICODE_STRING unregisterCallbacks = RTL_CONSTANT_STRING(L"UnregisterCallbacks");
+
+    UNREFERENCED_PARAMETER(DriverObject);
+
+    PAGED_CODE();
+
+    //
+    // Unregister the callback.
+    //
+    data = (VOID*)&HandleGetOrSetVariable;
+    size = sizeof(data);
+    status = ExGetFirmwareEnvironmentVariable(&unregisterCallbacks,
+                                              (GUID*)&g_BackdoorGuid,
+                                              &data,
+                                              &size,
+                                              NULL);
+    NT_ASSERT(NT_SUCCESS(status));
+}
+
+/**
+ * @brief The module entry point. Prints out all buffered logs and registers a callback.
+ */
+NTSTATUS
+DriverEntry (
+    _In_ PDRIVER_OBJECT DriverObject,
+    _In_ PUNICODE_STRING RegistryPath
+    )
+{
+    NTSTATUS status;
+    ULONG size;
+    VARIABLE_CALLBACK_SUBSCRIPTION subscription;
+    UNICODE_STRING registerCallbacks = RTL_CONSTANT_STRING(L"RegisterCallbacks");
+
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    DriverObject->DriverUnload = DriverUnload;
+
+    //
+    // Print out the saved logs.
+    //
+    status = DrainLogs();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Register the callback for the post-callbacks of Get/SetVariable only.
+    //
+    RtlZeroMemory(&subscription, sizeof(subscription));
+    subscription.Callback = &HandleGetOrSetVariable;
+    subscription.CallbackTypeMask = (CALLBACK_TYPE_MASK_GET | CALLBACK_TYPE_MASK_SET);
+    subscription.OperationTypeMask = OPERATION_TYPE_MASK_POST;
+    size = sizeof(subscription);
+    status = ExGetFirmwareEnvironmentVariable(&registerCallbacks,
+                                              (GUID*)&g_BackdoorGuid,
+                                              &subscription,
+                                              &size,
+                                              NULL);
+    if (!NT_SUCCESS(status))
+    {
+        DbgPrintEx(DPFLTR_IHVDRIVER_ID,
+                   DPFLTR_ERROR_LEVEL,
+                   "ExGetFirmwareEnvironmentVariable(RegisterCallbacks) failed : %08x\n",
+                   status);
+        goto Exit;
+    }
+
+Exit:
+    return status;
+}
@@ -1,831 +1,6595 @@
-#include "UefiVarMonitorExDxe.h"
-#include <Uefi.h>
-#include <Guid/EventGroup.h>
-#include <Library/BaseLib.h>
-#include <Library/BaseMemoryLib.h>
-#include <Library/DebugLib.h>
-#include <Library/MemoryAllocationLib.h>
-#include <Library/PrintLib.h>
-#include <Library/SynchronizationLib.h>
-#include <Library/UefiBootServicesTableLib.h>
-#include <Library/UefiLib.h>
-#include <Library/UefiRuntimeServicesTableLib.h>
-#include <library/UefiRuntimeLib.h>
-
-//
-// 256KB should be enough for every one, eh?
-//
-#define RUNTIME_BUFFER_SIZE_IN_PAGES    ((UINTN)64)
-#define RUNTIME_BUFFER_SIZE_IN_BYTES    (RUNTIME_BUFFER_SIZE_IN_PAGES * EFI_PAGE_SIZE)
-
-static EFI_EVENT g_SetVaMapEvent;
-static EFI_GET_VARIABLE g_GetVariable;
-static EFI_SET_VARIABLE g_SetVariable;
-
-//
-// Log buffer related.
-//
-static SPIN_LOCK g_LogBufferSpinLock;
-static UINT8* g_LogBuffer;
-static UINTN g_CurrentPoision;
-
-//
-// Callbacks.
-//
-static SPIN_LOCK g_VariableCallbacksLock;
-static VARIABLE_CALLBACK g_VariableCallbacks[8];
-
-
-#if defined(_MSC_VER)
-//
-// MSVC compiler intrinsics for CR8 access.
-//
-UINTN __readcr8(VOID);
-VOID __writecr8(UINTN Data);
-
-#elif defined(__GNUC__)
-//
-// Inline assemblies for CR8 access.
-//
-static
-__inline__
-__attribute__((always_inline))
-UINTN
-__readcr8 (
-    VOID
-    )
-{
-    UINTN value;
-
-    __asm__ __volatile__ (
-        "mov %%cr8, %[value]"
-        : [value] "=a" (value)
-    );
-    return value;
-}
-
-static
-__inline__
-__attribute__((always_inline))
-VOID
-__writecr8 (
-    UINTN Data
-    )
-{
-    __asm__ __volatile__ (
-        "mov %%eax, %%cr8"
-        :
-        : "a" (Data)
-    );
-}
-#endif
-
-/**
- * @brief Disables low-priority interrupts and acquires the spin lock,
- */
-static
-VOID
-AcquireSpinLockForNt (
-    IN OUT SPIN_LOCK* SpinLock,
-    OUT UINTN* OldInterruptState
-    )
-{
-    static CONST UINTN dispatchLevel = 2;
-
-    *OldInterruptState = __readcr8();
-    ASSERT(*OldInterruptState <= dispatchLevel);
-
-    __writecr8(dispatchLevel);
-    AcquireSpinLock(SpinLock);
-}
-
-/**
- * @brief Enables low-level interrupts and releases the spin lock.
- */
-static
-VOID
-ReleaseSpinLockForNt (
-    IN OUT SPIN_LOCK* SpinLock,
-    IN UINTN NewInterruptState
-    )
-{
-    ReleaseSpinLock(SpinLock);
-    __writecr8(NewInterruptState);
-}
-
-/**
- * @brief Adds the new log entry to the global log buffer.
- */
-static
-VOID
-AddLogEntryVariable(
-    VARIABLE_CALLBACK_TYPE CallbackType,
-    CONST CHAR16* VariableName,
-    CONST EFI_GUID* VendorGuid,
-    UINT32 Attributes,
-    UINTN DataSize,
-    CONST VOID* Data OPTIONAL,
-    EFI_STATUS Status
-    )
-{
-    UINTN interruptState;
-    UINTN entrySize;
-    VARIABLE_LOG_ENTRY* entry;
-
-    AcquireSpinLockForNt(&g_LogBufferSpinLock, &interruptState);
-
-    entrySize = sizeof(*entry) + DataSize;
-    if ((g_CurrentPoision + entrySize) <= RUNTIME_BUFFER_SIZE_IN_BYTES)
-    {
-        //
-        // Copy parameters to the log buffer.
-        //
-        entry = (VARIABLE_LOG_ENTRY*)&g_LogBuffer[g_CurrentPoision];
-        StrnCpyS(entry->VariableName,
-                 ARRAY_SIZE(entry->VariableName),
-                 VariableName,
-                 ARRAY_SIZE(entry->VariableName) - 1);
-        entry->VendorGuid = *VendorGuid;
-        entry->CallbackType = CallbackType;
-        entry->Attributes = Attributes;
-        entry->Status = Status;
-        AsciiSPrint(entry->StatusMessage, sizeof(entry->StatusMessage), "%r", Status);
-        entry->DataSize = DataSize;
-        CopyMem(entry->Data, Data, DataSize);
-
-        //
-        // Log entries must start at 16 byte alignment.
-        //
-        g_CurrentPoision += ALIGN_VALUE(entrySize, 0x10);
-        ASSERT((g_CurrentPoision % 0x10) == 0);
-    }
-
-    ReleaseSpinLockForNt(&g_LogBufferSpinLock, interruptState);
-
-    DebugPrint(DEBUG_VERBOSE,
-               "%c: %g Size=%08x %s: %r\n",
-               (CallbackType == VariableCallbackGet) ? L'G' : L'S',
-               VendorGuid,
-               DataSize,
-               VariableName,
-               Status);
-}
-
-/**
- * @brief Moves the contents of the log buffer to the provided buffer.
- */
-static
-EFI_STATUS
-HandleDrainBufferCommand (
-    OUT VOID* Buffer OPTIONAL,
-    IN OUT UINTN* BufferSize
-    )
-{
-    EFI_STATUS status;
-    UINTN interruptState;
-
-    ASSERT((Buffer != NULL) || (*BufferSize == 0));
-
-    //
-    // Return the log buffer size if the provided buffer size is smaller than that.
-    //
-    if (*BufferSize < RUNTIME_BUFFER_SIZE_IN_BYTES)
-    {
-        *BufferSize = RUNTIME_BUFFER_SIZE_IN_BYTES;
-        status = EFI_BUFFER_TOO_SMALL;
-        goto Exit;
-    }
-
-    //
-    // Copy the contents of log buffer to provided buffer and update the
-    // buffer size with the current size. Then, reset the log buffer and the
-    // current size.
-    //
-    AcquireSpinLockForNt(&g_LogBufferSpinLock, &interruptState);
-
-    CopyMem(Buffer, g_LogBuffer, g_CurrentPoision);
-    *BufferSize = g_CurrentPoision;
-    ZeroMem(g_LogBuffer, g_CurrentPoision);
-    g_CurrentPoision = 0;
-
-    ReleaseSpinLockForNt(&g_LogBufferSpinLock, interruptState);
-
-    status = EFI_SUCCESS;
-
-Exit:
-    return status;
-}
-
-/**
- * @brief Registers the callbacks of Get/SetVariable.
- */
-static
-EFI_STATUS
-HandleRegisterCallbacksCommand (
-    OUT VOID* Buffer OPTIONAL,
-    IN OUT UINTN* BufferSize
-    )
-{
-    EFI_STATUS status;
-    UINTN interruptState;
-    VARIABLE_CALLBACK callback;
-
-    if ((Buffer == NULL) ||
-        (*BufferSize != sizeof(VARIABLE_CALLBACK*)))
-    {
-        status = EFI_INVALID_PARAMETER;
-        goto Exit;
-    }
-
-    //
-    // Return this error when no slot is available.
-    //
-    status = EFI_OUT_OF_RESOURCES;
-    callback = *(VARIABLE_CALLBACK*)Buffer;
-
-    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
-
-    for (UINTN i = 0; i < ARRAY_SIZE(g_VariableCallbacks); i++)
-    {
-        //
-        // Register the callback if an empty slot is found.
-        //
-        if (g_VariableCallbacks[i] == NULL)
-        {
-            g_VariableCallbacks[i] = callback;
-            status = EFI_SUCCESS;
-            break;
-        }
-
-        //
-        // Return error if the same callback is already registered.
-        //
-        if (g_VariableCallbacks[i] == callback)
-        {
-            status = EFI_INVALID_PARAMETER;
-            break;
-        }
-    }
-
-    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
-
-    status = EFI_SUCCESS;
-
-Exit:
-    return status;
-}
-
-/**
- * @brief Unregisters the callback of Get/SetVariable.
- */
-static
-EFI_STATUS
-HandleUnregisterCallbacksCommand (
-    OUT VOID* Buffer OPTIONAL,
-    IN OUT UINTN* BufferSize
-    )
-{
-    EFI_STATUS status;
-    UINTN interruptState;
-    VARIABLE_CALLBACK callback;
-
-    if ((Buffer == NULL) ||
-        (*BufferSize != sizeof(VARIABLE_CALLBACK*)))
-    {
-        status = EFI_INVALID_PARAMETER;
-        goto Exit;
-    }
-
-    //
-    // Return this error when no slot is available.
-    //
-    status = EFI_INVALID_PARAMETER;
-    callback = *(VARIABLE_CALLBACK*)Buffer;
-
-    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
-
-    for (UINTN i = 0; i < ARRAY_SIZE(g_VariableCallbacks); i++)
-    {
-        //
-        // Clear the callback if the same ones as specified are found.
-        //
-        if (g_VariableCallbacks[i] == callback)
-        {
-            g_VariableCallbacks[i] = NULL;
-            status = EFI_SUCCESS;
-            break;
-        }
-    }
-
-    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
-
-
-Exit:
-    return status;
-}
-
-/**
- * @brief Handles the backdoor command.
- */
-static
-EFI_STATUS
-HandleBackdoorRequest (
-    IN CONST CHAR16* VariableName,
-    IN OUT VOID* Data OPTIONAL,
-    IN OUT UINTN* DataSize
-    )
-{
-    EFI_STATUS status;
-
-    if (StrCmp(VariableName, L"RegisterCallbacks") == 0)
-    {
-        status = HandleRegisterCallbacksCommand(Data, DataSize);
-    }
-    else if (StrCmp(VariableName, L"UnregisterCallbacks") == 0)
-    {
-        status = HandleUnregisterCallbacksCommand(Data, DataSize);
-    }
-    else if (StrCmp(VariableName, L"DrainBuffer") == 0)
-    {
-        status = HandleDrainBufferCommand(Data, DataSize);
-    }
-    else
-    {
-        status = EFI_INVALID_PARAMETER;
-    }
-
-    return status;
-}
-
-/**
- * @brief Invokes all registered callbacks.
- */
-static
-EFI_STATUS
-InvokeCallbacks (
-    IN OUT VARIABLE_CALLBACK_PARAMETERS* Parameters
-    )
-{
-    UINTN interruptState;
-    BOOLEAN blocked;
-
-    blocked = FALSE;
-
-    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
-
-    for (UINTN i = 0; i < ARRAY_SIZE(g_VariableCallbacks); i++)
-    {
-        if (g_VariableCallbacks[i] == NULL)
-        {
-            continue;
-        }
-
-        //
-        // Invoke a callback. The blocked status cannot be override if any of
-        // callbacks returned TRUE.
-        //
-        blocked |= g_VariableCallbacks[i](Parameters);
-    }
-
-    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
-
-    //
-    // Return EFI_ACCESS_DENIED if any of callbacks returned TRUE.
-    //
-    return (blocked == FALSE) ? EFI_SUCCESS : EFI_ACCESS_DENIED;
-}
-
-/**
- * @brief Invokes all registered Get callbacks.
- */
-static
-EFI_STATUS
-InvokeGetCallbacks (
-    IN OPERATION_TYPE OperationType,
-    IN OUT CHAR16** VariableName,
-    IN OUT EFI_GUID** VendorGuid,
-    IN OUT UINT32** Attributes OPTIONAL,
-    IN OUT UINTN** DataSize,
-    IN OUT VOID** Data OPTIONAL,
-    IN CONST EFI_STATUS* ResultStatus OPTIONAL
-    )
-{
-    BOOLEAN succeeded;
-    CHAR8 statusMessage[32];
-    CHAR8* statusMessagePtr;
-    VARIABLE_CALLBACK_PARAMETERS parameters;
-
-    //
-    // Convert the resulted status to a human readable string if it is given.
-    //
-    if (ResultStatus != NULL)
-    {
-        AsciiSPrint(statusMessage, sizeof(statusMessage), "%r", *ResultStatus);
-        statusMessagePtr = statusMessage;
-        succeeded = (EFI_ERROR(*ResultStatus) == FALSE);
-    }
-    else
-    {
-        statusMessagePtr = NULL;
-        succeeded = FALSE;
-    }
-
-    parameters.CallbackType = VariableCallbackGet;
-    parameters.OperationType = OperationType;
-    parameters.Parameters.Get.VariableName = VariableName;
-    parameters.Parameters.Get.VendorGuid = VendorGuid;
-    parameters.Parameters.Get.Attributes = Attributes;
-    parameters.Parameters.Get.DataSize = DataSize;
-    parameters.Parameters.Get.Data = Data;
-    parameters.Parameters.Get.Succeeded = succeeded;
-    parameters.Parameters.Get.StatusMessage = statusMessagePtr;
-
-    return InvokeCallbacks(&parameters);
-}
-
-/**
- * @brief Invokes all registered Set callbacks.
- */
-static
-EFI_STATUS
-ProcessSetCallbacks (
-    IN OPERATION_TYPE OperationType,
-    IN OUT CHAR16** VariableName,
-    IN OUT EFI_GUID** VendorGuid,
-    IN OUT UINT32* Attributes,
-    IN OUT UINTN* DataSize,
-    IN OUT VOID** Data,
-    IN CONST EFI_STATUS* ResultStatus OPTIONAL
-    )
-{
-    BOOLEAN succeeded;
-    CHAR8 statusMessage[32];
-    CHAR8* statusMessagePtr;
-    VARIABLE_CALLBACK_PARAMETERS parameters;
-
-    //
-    // Convert the resulted status to a human readable string if it is given.
-    //
-    if (ResultStatus != NULL)
-    {
-        AsciiSPrint(statusMessage, sizeof(statusMessage), "%r", *ResultStatus);
-        statusMessagePtr = statusMessage;
-        succeeded = (EFI_ERROR(*ResultStatus) == FALSE);
-    }
-    else
-    {
-        statusMessagePtr = NULL;
-        succeeded = FALSE;
-    }
-
-    parameters.CallbackType = VariableCallbackSet;
-    parameters.OperationType = OperationType;
-    parameters.Parameters.Set.VariableName = VariableName;
-    parameters.Parameters.Set.VendorGuid = VendorGuid;
-    parameters.Parameters.Set.Attributes = Attributes;
-    parameters.Parameters.Set.DataSize = DataSize;
-    parameters.Parameters.Set.Data = Data;
-    parameters.Parameters.Set.Succeeded = succeeded;
-    parameters.Parameters.Set.StatusMessage = statusMessagePtr;
-
-    return InvokeCallbacks(&parameters);
-}
-
-/**
- * @brief Handles GetVariable runtime service calls.
- */
-static
-EFI_STATUS
-EFIAPI
-HandleGetVariable (
-    IN CHAR16* VariableName,
-    IN EFI_GUID* VendorGuid,
-    OUT UINT32* Attributes OPTIONAL,
-    IN OUT UINTN* DataSize,
-    OUT VOID* Data OPTIONAL
-    )
-{
-    EFI_STATUS status;
-    UINTN effectiveDataSize;
-    UINT32 effectiveAttributes;
-
-    //
-    // Only execute a backdoor command if the certain GUID is specified.
-    //
-    if (CompareGuid(VendorGuid, &g_BackdoorGuid) != FALSE)
-    {
-        status = HandleBackdoorRequest(VariableName, Data, DataSize);
-        goto Exit;
-    }
-
-    //
-    // Invoke Pre- Get callbacks. Callbacks can make the service call fail.
-    //
-    status = InvokeGetCallbacks(OperationPre,
-                                &VariableName,
-                                &VendorGuid,
-                                &Attributes,
-                                &DataSize,
-                                &Data,
-                                NULL);
-    if (EFI_ERROR(status))
-    {
-        goto Exit;
-    }
-
-    //
-    // Invoke the original GetVariable service, and log this service invocation.
-    //
-    status = g_GetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
-    effectiveDataSize = EFI_ERROR(status) ? 0 : *DataSize;
-    effectiveAttributes = (EFI_ERROR(status) || (Attributes == NULL)) ? 0 : *Attributes;
-    AddLogEntryVariable(VariableCallbackGet,
-                        VariableName,
-                        VendorGuid,
-                        effectiveAttributes,
-                        effectiveDataSize,
-                        Data,
-                        status);
-
-    //
-    // Invoke Post- Get callbacks. Post callbacks cannot make the service fail.
-    //
-    InvokeGetCallbacks(OperationPost,
-                       &VariableName,
-                       &VendorGuid,
-                       &Attributes,
-                       &DataSize,
-                       &Data,
-                       &status);
-
-Exit:
-    return status;
-}
-
-/**
- * @brief Handles SetVariable runtime service calls.
- */
-static
-EFI_STATUS
-EFIAPI
-HandleSetVariable (
-    IN CHAR16* VariableName,
-    IN EFI_GUID* VendorGuid,
-    IN UINT32 Attributes,
-    IN UINTN DataSize,
-    IN VOID* Data
-    )
-{
-    EFI_STATUS status;
-
-    //
-    // Invoke Pre- Set callbacks. Callbacks can make the service call fail.
-    //
-    status = ProcessSetCallbacks(OperationPre,
-                                 &VariableName,
-                                 &VendorGuid,
-                                 &Attributes,
-                                 &DataSize,
-                                 &Data,
-                                 NULL);
-    if (EFI_ERROR(status))
-    {
-        goto Exit;
-    }
-
-    //
-    // Invoke the original SetVariable service, and log this service invocation.
-    //
-    status = g_SetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
-    AddLogEntryVariable(VariableCallbackSet,
-                        VariableName,
-                        VendorGuid,
-                        Attributes,
-                        DataSize,
-                        Data,
-                        status);
-
-    //
-    // Invoke Post- Set callbacks. Post callbacks cannot make the service fail.
-    //
-    ProcessSetCallbacks(OperationPost,
-                        &VariableName,
-                        &VendorGuid,
-                        &Attributes,
-                        &DataSize,
-                        &Data,
-                        &status);
-
-Exit:
-    return status;
-}
-
-/**
- * @brief Converts global pointers from physical-mode ones to virtual-mode ones.
- */
-static
-VOID
-EFIAPI
-HandleSetVirtualAddressMap (
-    IN EFI_EVENT Event,
-    IN VOID* Context
-    )
-{
-    EFI_STATUS status;
-    VOID* currentAddress;
-
-    currentAddress = (VOID*)g_GetVariable;
-    status = gRT->ConvertPointer(0, (VOID**)&g_GetVariable);
-    ASSERT_EFI_ERROR(status);
-    DEBUG((DEBUG_ERROR,
-           "GetVariable relocated from %p to %p\n",
-           currentAddress,
-           g_GetVariable));
-
-    currentAddress = (VOID*)g_SetVariable;
-    status = gRT->ConvertPointer(0, (VOID**)&g_SetVariable);
-    ASSERT_EFI_ERROR(status);
-    DEBUG((DEBUG_ERROR,
-           "SetVariable relocated from %p to %p\n",
-           currentAddress,
-           g_SetVariable));
-
-    currentAddress = (VOID*)g_LogBuffer;
-    status = gRT->ConvertPointer(0, (VOID**)&g_LogBuffer);
-    ASSERT_EFI_ERROR(status);
-    DEBUG((DEBUG_ERROR,
-           "RuntimeBuffer relocated from %p to %p\n",
-           currentAddress,
-           g_LogBuffer));
-}
-
-/**
- * @brief Exchanges a pointer in the EFI System Table.
- */
-static
-EFI_STATUS
-ExchangePointerInServiceTable (
-    IN OUT VOID** AddressToUpdate,
-    IN VOID* NewPointer,
-    OUT VOID** OriginalPointer OPTIONAL
-    )
-{
-    EFI_STATUS status;
-    EFI_TPL tpl;
-
-    ASSERT(*AddressToUpdate != NewPointer);
-
-    tpl = gBS->RaiseTPL(TPL_HIGH_LEVEL);
-
-    //
-    // Save the current value if needed.
-    //
-    if (OriginalPointer != NULL)
-    {
-        *OriginalPointer = *AddressToUpdate;
-    }
-    *AddressToUpdate = NewPointer;
-
-    //
-    // Update the CRC32 in the EFI System Table header.
-    //
-    gST->Hdr.CRC32 = 0;
-    status = gBS->CalculateCrc32(&gST->Hdr, gST->Hdr.HeaderSize, &gST->Hdr.CRC32);
-    ASSERT_EFI_ERROR(status);
-
-    gBS->RestoreTPL(tpl);
-    return status;
-}
-
-/**
- * @brief Cleans up changes made by this module and release resources.
- *
- * @details This function handles pertical clean up and is safe for multiple calls.
- */
-static
-VOID
-Cleanup (
-    VOID
-    )
-{
-    EFI_STATUS status;
-
-    ASSERT(EfiAtRuntime() == FALSE);
-
-    if (gST->RuntimeServices->SetVariable == HandleSetVariable)
-    {
-        status = ExchangePointerInServiceTable(
-                                    (VOID**)&gST->RuntimeServices->SetVariable,
-                                    (VOID*)g_SetVariable,
-                                    NULL);
-        ASSERT_EFI_ERROR(status);
-    }
-
-    if (gST->RuntimeServices->GetVariable == HandleGetVariable)
-    {
-        status = ExchangePointerInServiceTable(
-                                    (VOID**)&gST->RuntimeServices->GetVariable,
-                                    (VOID*)g_GetVariable,
-                                    NULL);
-        ASSERT_EFI_ERROR(status);
-    }
-
-    if (g_SetVaMapEvent != NULL)
-    {
-        status = gBS->CloseEvent(&g_SetVaMapEvent);
-        g_SetVaMapEvent = NULL;
-        ASSERT_EFI_ERROR(status);
-    }
-
-    if (g_LogBuffer != NULL)
-    {
-        FreePages(g_LogBuffer, RUNTIME_BUFFER_SIZE_IN_PAGES);
-        g_LogBuffer = NULL;
-    }
-}
-
-/**
- * @brief The module entry point.
- */
-EFI_STATUS
-EFIAPI
-UefiVarMonitorDxeInitialize (
-    IN EFI_HANDLE ImageHandle,
-    IN EFI_SYSTEM_TABLE* SystemTable
-    )
-{
-    EFI_STATUS status;
-
-    InitializeSpinLock(&g_LogBufferSpinLock);
-    InitializeSpinLock(&g_VariableCallbacksLock);
-
-    DEBUG((DEBUG_ERROR, "Driver being loaded\n"));
-
-    //
-    // Allocate the memory that is availabe for use even at the runtime phase.
-    //
-    g_LogBuffer = AllocateRuntimePages(RUNTIME_BUFFER_SIZE_IN_PAGES);
-    if (g_LogBuffer == NULL)
-    {
-        status = EFI_OUT_OF_RESOURCES;
-        DEBUG((DEBUG_ERROR, "AllocateRuntimePages failed\n"));
-        goto Exit;
-    }
-    ZeroMem(g_LogBuffer, RUNTIME_BUFFER_SIZE_IN_PAGES * EFI_PAGE_SIZE);
-
-    //
-    // Register a notification for SetVirtualAddressMap call.
-    //
-    status = gBS->CreateEventEx(EVT_NOTIFY_SIGNAL,
-                                TPL_CALLBACK,
-                                HandleSetVirtualAddressMap,
-                                NULL,
-                                &gEfiEventVirtualAddressChangeGuid,
-                                &g_SetVaMapEvent);
-    if (EFI_ERROR(status))
-    {
-        DEBUG((DEBUG_ERROR, "CreateEventEx failed : %r\n", status));
-        goto Exit;
-    }
-
-    //
-    // Install hooks. At this point, everything that is used in the hook handlers
-    // must be initialized.
-    //
-    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->GetVariable,
-                                           (VOID*)HandleGetVariable,
-                                           (VOID**)&g_GetVariable);
-    if (EFI_ERROR(status))
-    {
-        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(GetVariable) failed : %r\n", status));
-        goto Exit;
-    }
-    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->SetVariable,
-                                           (VOID*)HandleSetVariable,
-                                           (VOID**)&g_SetVariable);
-    if (EFI_ERROR(status))
-    {
-        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(SetVariable) failed : %r\n", status));
-        goto Exit;
-    }
-
-Exit:
-    if (EFI_ERROR(status))
-    {
-        Cleanup();
-    }
-    return status;
-}
-
-/**
- * @brief Handles unload request of this module.
- */
-EFI_STATUS
-EFIAPI
-UefiVarMonitorDxeUnload (
-    IN EFI_HANDLE ImageHandle
-    )
-{
-    Cleanup();
-    return EFI_SUCCESS;
-}
+#include "UefiVarMonitorExDxe.h"
+#include <Uefi.h>
+#include <Guid/EventGroup.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/PcdLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/UefiLib.h>
+#include <Library/UefiRuntimeServicesTableLib.h>
+#include <library/UefiRuntimeLib.h>
+#include <Protocol/MpService.h>
+
+//
+// The initial and the largest sizes of each of the two log rings allocated for
+// each processor. Rings grow up to the configured size while boot services are
+// available.
+//
+#define LOG_RING_INITIAL_SIZE_IN_PAGES  ((UINTN)1)
+#define LOG_RING_MAX_SIZE_IN_PAGES      ((UINTN)4096)
+
+//
+// The number of processor contexts allocated when the number of processors
+// cannot be determined through the MP Services protocol.
+//
+#define DEFAULT_PROCESSOR_COUNT         ((UINTN)16)
+
+//
+// The APIC ID value indicating that the processor context is not claimed yet.
+//
+#define UNOWNED_APIC_ID                 MAX_UINT32
+
+//
+// The bit of g_LogSequenceNumber selecting the log rings producers add records
+// to. The rest of the bits are the next sequence number.
+//
+#define ACTIVE_LOG_RING_BIT             BIT63
+
+//
+// The number of the slots in the hash table of the log filter. This must be a
+// power of two and larger than MAX_LOG_FILTER_RULES.
+//
+#define LOG_FILTER_HASH_SIZE            ((UINTN)128)
+
+//
+// The number of the slots in the hash table of the variable names. This must
+// be a power of two and larger than MAX_VARIABLE_NAMES.
+//
+#define VARIABLE_NAME_HASH_SIZE         ((UINTN)1024)
+
+//
+// The number of the entries of the read cache, and the largest variable data
+// size each entry can hold.
+//
+#define READ_CACHE_ENTRY_COUNT          ((UINTN)64)
+#define READ_CACHE_MAX_DATA_SIZE        ((UINTN)1024)
+
+//
+// The number of the entries of the negative cache. This must be a power of two.
+//
+#define NEGATIVE_CACHE_ENTRY_COUNT      ((UINTN)128)
+
+//
+// The number of the events the queue of each deferred callback can hold. The
+// queue is allocated from the arena, and must fit in its largest size class.
+//
+#define DEFERRED_CALLBACK_QUEUE_LENGTH  ((UINTN)64)
+
+//
+// The number of the entries each callback set can hold initially. Sets grow by
+// doubling it.
+//
+#define INITIAL_CALLBACK_SET_CAPACITY   ((UINTN)8)
+
+//
+// The size of the arena the structures growing at runtime are allocated from,
+// and its size classes. Blocks of the size class N are ARENA_BLOCK_SIZE(N)
+// bytes. Each processor keeps up to ARENA_PROCESSOR_CACHE_LIMIT free blocks of
+// each size class.
+//
+#define ARENA_SIZE_IN_PAGES             ((UINTN)96)
+#define ARENA_SIZE_CLASS_COUNT          ((UINTN)11)
+#define ARENA_BLOCK_SIZE(SizeClass)     ((UINTN)64 << (SizeClass))
+#define ARENA_PROCESSOR_CACHE_LIMIT     ((UINT32)8)
+#define ARENA_INVALID_OFFSET            MAX_UINT32
+
+//
+// The period to measure the TSC frequency over when CPUID does not report it.
+//
+#define TSC_CALIBRATION_PERIOD_IN_US    ((UINTN)10000)
+
+//
+// The types of records in the log ring.
+//
+typedef enum _LOG_RECORD_TYPE
+{
+    LogRecordEntry,
+    LogRecordPadding,
+} LOG_RECORD_TYPE;
+
+//
+// The header of each record in the log ring. VARIABLE_LOG_ENTRY follows unless
+// the record is padding that fills up the end of the ring.
+//
+typedef struct _LOG_RECORD_HEADER
+{
+    UINT32 RecordSize;
+    UINT32 RecordType;
+    UINT64 SequenceNumber;
+} LOG_RECORD_HEADER;
+
+//
+// The log ring. Both offsets increase monotonically and are wrapped only when
+// the ring buffer is accessed.
+//
+// Each processor has two rings. The processor adds records only to the active
+// ring, while the drain command removes records only from the other, inactive
+// ring. The drain command swaps them once the inactive rings are empty. Hence,
+// a ring is never accessed by the producer and the consumer at the same time.
+//
+// The statistics are updated only by the producer. So is the buffer, which the
+// producer may replace with a larger one while boot services are available.
+//
+typedef struct _LOG_RING
+{
+    UINT8* Buffer;
+    UINTN Size;
+    UINT64 Head;
+    UINT64 Tail;
+    UINT64 DroppedEntries;
+    UINT64 OverwrittenEntries;
+    UINT64 HighWaterMark;
+} LOG_RING;
+
+//
+// The latency histograms of the calls on the processor. They are updated only
+// by the processor, and summed up when read.
+//
+typedef struct _LATENCY_STATISTICS
+{
+    UINT64 Service[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+    UINT64 Hook[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+    UINT64 Callback[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+} LATENCY_STATISTICS;
+
+//
+// The list of the free blocks of the arena. Blocks are linked with the offset
+// from the start of the arena stored in the first four bytes of each block.
+//
+typedef struct _ARENA_FREE_LIST
+{
+    UINT32 Head;
+    UINT32 Count;
+} ARENA_FREE_LIST;
+
+//
+// The per-processor data. Processor numbers are not available at runtime, so
+// a processor claims a context with its APIC ID on the first use.
+//
+// PendingSequenceNumber is a lower bound of the sequence number of the entry
+// being added, or MAX_UINT64 if none. The drain command uses it to wait for
+// the processor to finish adding an entry to the ring being swapped out.
+//
+// ReadingCallbackSet is the index of the callback set the processor is
+// running plus one, or 0 if none. Writers use it to wait for the processor to
+// finish running the callbacks in the set they are about to retire.
+//
+// ArenaCache is the free blocks of the arena freed on the processor. It is
+// accessed only by the processor.
+//
+typedef struct _PROCESSOR_CONTEXT
+{
+    volatile UINT32 ApicId;
+    volatile UINT32 ReadingCallbackSet;
+    volatile UINT64 PendingSequenceNumber;
+    LOG_RING LogRings[2];
+    LATENCY_STATISTICS Latency;
+    ARENA_FREE_LIST ArenaCache[ARENA_SIZE_CLASS_COUNT];
+} PROCESSOR_CONTEXT;
+
+//
+// The arena over the runtime pages. Blocks are carved out from the start of
+// the unused part, and never returned to it. The lock protects the shared free
+// lists and Used.
+//
+typedef struct _ARENA
+{
+    SPIN_LOCK Lock;
+    UINT8* Base;
+    UINT32 Size;
+    UINT32 Used;
+    UINT64 Failures;
+    ARENA_FREE_LIST FreeLists[ARENA_SIZE_CLASS_COUNT];
+} ARENA;
+
+//
+// The bit of CALLBACK_ENTRY.SubscribedCalls for the pair of the callback type
+// and the operation type.
+//
+#define CALLBACK_CALL_BIT(CallbackType, OperationType) \
+    (1u << ((CallbackType) * 2 + (OperationType)))
+
+//
+// The queue of the events for the deferred callback. Each deferred callback
+// has its own queue, so that a callback whose events are not drained only
+// loses its own events. Events from Head are in use, and everything is
+// protected by the lock.
+//
+typedef struct _DEFERRED_CALLBACK_QUEUE
+{
+    SPIN_LOCK Lock;
+    UINT32 Head;
+    UINT32 Count;
+    UINT64 DroppedEvents;
+    DEFERRED_CALLBACK_EVENT Events[DEFERRED_CALLBACK_QUEUE_LENGTH];
+} DEFERRED_CALLBACK_QUEUE;
+
+//
+// The registered callback and its subscription. DeferredQueue is allocated
+// from the arena for the callback with SUBSCRIPTION_FLAG_DEFERRED, and is
+// shared by the copies of the entry in both callback sets.
+//
+typedef struct _CALLBACK_ENTRY
+{
+    VARIABLE_CALLBACK Callback;
+    UINT32 SubscribedCalls;
+    UINT32 Flags;
+    UINT32 Filters;
+    UINT32 Priority;
+    EFI_GUID VendorGuid;
+    UINTN NamePrefixLength;
+    CHAR16 NamePrefix[32];
+    DEFERRED_CALLBACK_QUEUE* DeferredQueue;
+} CALLBACK_ENTRY;
+
+//
+// The set of the registered callbacks. A published set is never modified.
+// Writers build a new set in the other slot, publish it, and wait for readers
+// of the previous set to finish. Entries are sorted by the priority and are
+// allocated in runtime memory, holding up to Capacity entries.
+//
+typedef struct _CALLBACK_SET
+{
+    UINTN Count;
+    UINTN Capacity;
+    UINT32 SubscribedCalls;     // Union of SubscribedCalls of all entries
+    CALLBACK_ENTRY* Entries;
+} CALLBACK_SET;
+
+//
+// The rule of the log filter along with the length of its name.
+//
+typedef struct _LOG_FILTER_ENTRY
+{
+    LOG_FILTER_RULE Rule;
+    UINTN NameLength;
+} LOG_FILTER_ENTRY;
+
+//
+// The slot of the hash table of the log filter. RuleIndex is the index of the
+// rule plus one, or 0 if the slot is empty.
+//
+typedef struct _LOG_FILTER_SLOT
+{
+    UINT32 Hash;
+    UINT32 RuleIndex;
+} LOG_FILTER_SLOT;
+
+//
+// The compiled log filter. Rules matching an exact name are indexed by the hash
+// of the name, so that a call is checked against only the rules for its name
+// and the rules without a name.
+//
+typedef struct _LOG_FILTER
+{
+    UINT32 RuleCount;
+    UINT32 IncludeRuleCount;
+    UINT32 UnhashedRuleCount;
+    UINT32 UnhashedRules[MAX_LOG_FILTER_RULES];
+    LOG_FILTER_SLOT Slots[LOG_FILTER_HASH_SIZE];
+    LOG_FILTER_ENTRY Entries[MAX_LOG_FILTER_RULES];
+} LOG_FILTER;
+
+//
+// The result of the log filter evaluation. The rule indexes are those of the
+// rules deciding each policy, or MAX_UINT32 if none.
+//
+typedef struct _LOG_FILTER_RESULT
+{
+    BOOLEAN Included;
+    BOOLEAN Excluded;
+    UINT32 CaptureRuleIndex;
+    UINT32 SamplingRuleIndex;
+    UINT32 RateLimitRuleIndex;
+} LOG_FILTER_RESULT;
+
+//
+// How the call is logged, resolved from the log filter and the configuration.
+//
+typedef struct _LOG_POLICY
+{
+    CAPTURE_MODE CaptureMode;
+    UINT32 CaptureSize;
+    UINT32 SampleInterval;
+    UINT32 RateLimit;
+    UINT32 RateBurst;
+} LOG_POLICY;
+
+//
+// The slot of the hash table of the variable names. VariableId is
+// VARIABLE_ID_UNKNOWN if the slot is empty.
+//
+typedef struct _VARIABLE_NAME_SLOT
+{
+    UINT32 Hash;
+    volatile UINT32 VariableId;
+} VARIABLE_NAME_SLOT;
+
+//
+// The statistics of the variable. They are updated by any processors. The
+// latency histograms are updated with interlocked operations, and the rest are
+// under the lock so that they are read consistently.
+//
+// The shadow digest is valid only while the value of the variable is known.
+// ShadowGeneration is incremented whenever SetVariable for the variable starts
+// or completes, so that the value read or written concurrently is discarded.
+//
+typedef struct _VARIABLE_STATISTICS
+{
+    volatile UINT32 ServiceLatency[2][LATENCY_HISTOGRAM_BUCKETS];
+    SPIN_LOCK Lock;
+    UINT64 GetCount;
+    UINT64 SetCount;
+    UINT64 ErrorCount;
+    UINT64 BytesRead;
+    UINT64 BytesWritten;
+    EFI_STATUS LastStatus;
+    UINT32 LastAttributes;
+    UINT32 SampleCounter;
+    UINT32 SuppressedEntries;
+    UINT64 TotalSuppressedEntries;
+    UINT64 NextLogTsc;
+    UINT64 RedundantWrites;
+    UINT64 RedundantBytes;
+    BOOLEAN ShadowValid;
+    UINT32 ShadowAttributes;
+    UINT32 PendingWrites;
+    volatile UINT32 ShadowGeneration;
+    UINTN ShadowDataSize;
+    UINT64 ShadowDigest;
+} VARIABLE_STATISTICS;
+
+//
+// The table of the variable names. Records and statistics are indexed by the
+// ID minus one. Records are never modified once Count covers them.
+//
+typedef struct _VARIABLE_NAME_TABLE
+{
+    volatile UINT32 Count;
+    VARIABLE_NAME_SLOT Slots[VARIABLE_NAME_HASH_SIZE];
+    VARIABLE_NAME_RECORD Records[MAX_VARIABLE_NAMES];
+    VARIABLE_STATISTICS Statistics[MAX_VARIABLE_NAMES];
+} VARIABLE_NAME_TABLE;
+
+//
+// The SetVariable call in progress for the shadow digest. VariableId is
+// VARIABLE_ID_UNKNOWN if the digest is not updated with the call. Exclusive
+// indicates that no other call for the variable was in progress at the start.
+//
+typedef struct _SHADOW_UPDATE
+{
+    UINT32 VariableId;
+    UINT32 Generation;
+    UINT64 Digest;
+    BOOLEAN Exclusive;
+    BOOLEAN Skipped;
+} SHADOW_UPDATE;
+
+//
+// The entry of the read cache. VariableId is VARIABLE_ID_UNKNOWN if the entry
+// is free.
+//
+typedef struct _READ_CACHE_ENTRY
+{
+    UINT32 VariableId;
+    UINT32 Attributes;
+    UINT64 LastUsed;
+    UINTN DataSize;
+    UINT8 Data[READ_CACHE_MAX_DATA_SIZE];
+} READ_CACHE_ENTRY;
+
+//
+// The entry of the negative cache. The entry is free if VariableName is empty.
+// Names truncated in the variable name table are never cached, so the name
+// always fits.
+//
+typedef struct _NEGATIVE_CACHE_ENTRY
+{
+    UINT32 Hash;
+    EFI_GUID VendorGuid;
+    CHAR16 VariableName[64];
+} NEGATIVE_CACHE_ENTRY;
+
+//
+// The read cache. Entries are looked up by the variable ID through
+// EntryIndexes, which holds the index of the entry plus one, or 0 if the
+// variable is not cached. Everything is protected by the lock.
+//
+// The negative cache is the direct-mapped table indexed by the hash of the
+// variable, and keeps the exact names of the variables not found. It is kept
+// apart from the variable name table so that probing for missing variables,
+// which boot loaders do a lot, does not fill up the variable name table; a new
+// entry simply replaces the entry in the same slot.
+//
+// Generation is incremented whenever entries are invalidated, and
+// PendingSetCount is the number of SetVariable calls in progress. Data read
+// from the original service is cached only if neither happened during the
+// read, as the data may be stale otherwise.
+//
+typedef struct _READ_CACHE
+{
+    SPIN_LOCK Lock;
+    UINT32 PendingSetCount;
+    UINT64 Generation;
+    UINT64 Clock;
+    UINT64 Hits;
+    UINT64 Misses;
+    UINT64 Evictions;
+    UINT64 Invalidations;
+    UINT64 NegativeHits;
+    UINT64 NegativeInsertions;
+    UINT64 NegativeInvalidations;
+    NEGATIVE_CACHE_ENTRY NotFound[NEGATIVE_CACHE_ENTRY_COUNT];
+    UINT8 EntryIndexes[MAX_VARIABLE_NAMES];
+    READ_CACHE_ENTRY Entries[READ_CACHE_ENTRY_COUNT];
+} READ_CACHE;
+
+//
+// The name index. VariableIds lists the variables in the store sorted by
+// CompareVariableOrder, and Positions holds the position of the variable plus
+// one, or 0 if not listed, indexed by the variable ID minus one. Everything is
+// protected by the lock.
+//
+// Generation is incremented whenever SetVariable starts or completes, and
+// PendingSetCount is the number of SetVariable calls in progress. The index is
+// built only while no SetVariable call is in progress, and is discarded if
+// any is called during the build.
+//
+// ReturnedByIndex is TRUE if the variable was last returned from the index
+// rather than the original service, indexed by the variable ID minus one. It
+// tells which order the enumeration continuing from the variable is in.
+//
+typedef struct _NAME_INDEX
+{
+    SPIN_LOCK Lock;
+    BOOLEAN Valid;
+    BOOLEAN Building;
+    BOOLEAN Failed;
+    BOOLEAN BuiltAtRuntime;
+    UINT32 PendingSetCount;
+    UINT32 Generation;
+    UINT32 Count;
+    UINT64 Hits;
+    UINT64 Builds;
+    UINT32 VariableIds[MAX_VARIABLE_NAMES];
+    UINT16 Positions[MAX_VARIABLE_NAMES];
+    BOOLEAN ReturnedByIndex[MAX_VARIABLE_NAMES];
+} NAME_INDEX;
+
+//
+// The watch list. WatchIndexes is the index of the watch entry plus one, or 0
+// if the variable is not watched, indexed by the variable ID minus one. The
+// lock serializes writers. SetVariable calls read it without the lock.
+//
+typedef struct _WATCH_LIST
+{
+    SPIN_LOCK Lock;
+    volatile UINT32 Count;
+    volatile UINT32 Generation;
+    volatile UINT64 DirtyBitmap;
+    UINT8 WatchIndexes[MAX_VARIABLE_NAMES];
+} WATCH_LIST;
+
+static EFI_EVENT g_SetVaMapEvent;
+static EFI_EVENT g_ReadyToBootEvent;
+static EFI_EVENT g_BeforeExitBootServicesEvent;
+static EFI_GET_VARIABLE g_GetVariable;
+static EFI_SET_VARIABLE g_SetVariable;
+static EFI_GET_NEXT_VARIABLE_NAME g_GetNextVariableName;
+static EFI_QUERY_VARIABLE_INFO g_QueryVariableInfo;
+
+//
+// Per-processor contexts.
+//
+static PROCESSOR_CONTEXT* g_Processors;
+static UINTN g_ProcessorCount;
+static BOOLEAN g_X2ApicIdSupported;
+
+//
+// The arena for the structures that grow at runtime.
+//
+static ARENA g_Arena;
+
+//
+// Log buffer related. The buffer is split into the log rings of each processor.
+// The lock only serializes drain commands and is never acquired by producers.
+// g_LogDrainLimit is the sequence number at which the rings were swapped last
+// time, which is the upper bound of the entries in the inactive rings.
+// g_LogRingsFrozen is set once rings can no longer grow.
+//
+static SPIN_LOCK g_LogDrainLock;
+static UINTN g_LogRingSizeInPages;
+static volatile BOOLEAN g_LogRingsFrozen;
+static volatile UINT64 g_LogSequenceNumber;
+static UINT64 g_LogDrainLimit;
+static volatile LOG_MODE g_LogMode;
+static volatile CAPTURE_MODE g_CaptureMode;
+static volatile UINT32 g_CaptureSize;
+static LOG_BUFFER_HEADER g_LogBufferHeader;
+static volatile UINT32 g_MonitorFlags;
+
+//
+// Callbacks. The lock serializes writers. Readers acquire it only when the
+// current processor does not have its context.
+//
+static SPIN_LOCK g_VariableCallbacksLock;
+static CALLBACK_SET g_CallbackSets[2];
+static volatile UINT32 g_PublishedCallbackSetIndex;
+
+//
+// Log filter. The lock serializes writers. Readers do not lock, and instead,
+// retry when the version is odd or changed while they read the filter.
+//
+static SPIN_LOCK g_LogFilterLock;
+static LOG_FILTER g_LogFilter;
+static volatile UINT32 g_LogFilterVersion;
+
+//
+// Variable names. The lock serializes registration of new names. Lookup does
+// not lock as slots are published only after their records are written.
+//
+static SPIN_LOCK g_VariableNamesLock;
+static VARIABLE_NAME_TABLE* g_VariableNames;
+
+//
+// The read cache in front of the original GetVariable service.
+//
+static READ_CACHE* g_ReadCache;
+
+//
+// The name index in front of the original GetNextVariableName service.
+//
+static NAME_INDEX g_NameIndex;
+
+//
+// The watch list of the variables whose updates are tracked.
+//
+static WATCH_LIST g_WatchList;
+
+#if defined(_MSC_VER)
+//
+// MSVC compiler intrinsics for CR8 access.
+//
+UINTN __readcr8(VOID);
+VOID __writecr8(UINTN Data);
+
+#elif defined(__GNUC__)
+//
+// Inline assemblies for CR8 access.
+//
+static
+__inline__
+__attribute__((always_inline))
+UINTN
+__readcr8 (
+    VOID
+    )
+{
+    UINTN value;
+
+    __asm__ __volatile__ (
+        "mov %%cr8, %[value]"
+        : [value] "=a" (value)
+    );
+    return value;
+}
+
+static
+__inline__
+__attribute__((always_inline))
+VOID
+__writecr8 (
+    UINTN Data
+    )
+{
+    __asm__ __volatile__ (
+        "mov %%eax, %%cr8"
+        :
+        : "a" (Data)
+    );
+}
+#endif
+
+/**
+ * @brief Disables low-priority interrupts.
+ */
+static
+VOID
+RaiseToDispatchLevelForNt (
+    OUT UINTN* OldInterruptState
+    )
+{
+    static CONST UINTN dispatchLevel = 2;
+
+    *OldInterruptState = __readcr8();
+    ASSERT(*OldInterruptState <= dispatchLevel);
+
+    __writecr8(dispatchLevel);
+}
+
+/**
+ * @brief Enables low-priority interrupts.
+ */
+static
+VOID
+RestoreInterruptStateForNt (
+    IN UINTN NewInterruptState
+    )
+{
+    __writecr8(NewInterruptState);
+}
+
+/**
+ * @brief Disables low-priority interrupts and acquires the spin lock,
+ */
+static
+VOID
+AcquireSpinLockForNt (
+    IN OUT SPIN_LOCK* SpinLock,
+    OUT UINTN* OldInterruptState
+    )
+{
+    RaiseToDispatchLevelForNt(OldInterruptState);
+    AcquireSpinLock(SpinLock);
+}
+
+/**
+ * @brief Enables low-level interrupts and releases the spin lock.
+ */
+static
+VOID
+ReleaseSpinLockForNt (
+    IN OUT SPIN_LOCK* SpinLock,
+    IN UINTN NewInterruptState
+    )
+{
+    ReleaseSpinLock(SpinLock);
+    RestoreInterruptStateForNt(NewInterruptState);
+}
+
+/**
+ * @brief Returns the APIC ID of the current processor.
+ */
+static
+UINT32
+GetCurrentApicId (
+    VOID
+    )
+{
+    UINT32 ebx;
+    UINT32 edx;
+
+    //
+    // Prefer the x2APIC ID as the initial APIC ID in CPUID.01h is only 8 bits.
+    //
+    if (g_X2ApicIdSupported != FALSE)
+    {
+        AsmCpuidEx(0xb, 0, NULL, NULL, NULL, &edx);
+        return edx;
+    }
+
+    AsmCpuid(1, NULL, &ebx, NULL, NULL);
+    return (ebx >> 24);
+}
+
+/**
+ * @brief Returns the context of the current processor, claiming one if needed.
+ *
+ * @details The caller must disable low-priority interrupts, so that the thread
+ *      is not rescheduled onto another processor while using the context.
+ *      NULL is returned if all contexts are claimed by other processors.
+ */
+static
+PROCESSOR_CONTEXT*
+GetCurrentProcessorContext (
+    VOID
+    )
+{
+    UINT32 apicId;
+    PROCESSOR_CONTEXT* context;
+
+    apicId = GetCurrentApicId();
+
+    //
+    // Probe contexts starting at the APIC ID-derived position. APIC IDs tend to
+    // be dense, so this finds the context with the first probe in most cases.
+    //
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        context = &g_Processors[(apicId + i) % g_ProcessorCount];
+        if (context->ApicId == apicId)
+        {
+            return context;
+        }
+
+        if ((context->ApicId == UNOWNED_APIC_ID) &&
+            (InterlockedCompareExchange32(&context->ApicId,
+                                          UNOWNED_APIC_ID,
+                                          apicId) == UNOWNED_APIC_ID))
+        {
+            return context;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Returns the index of the smallest size class of the arena holding the
+ *      size, or ARENA_SIZE_CLASS_COUNT if too large.
+ */
+static
+UINTN
+GetArenaSizeClass (
+    IN UINTN Size
+    )
+{
+    UINTN sizeClass;
+
+    for (sizeClass = 0; sizeClass < ARENA_SIZE_CLASS_COUNT; sizeClass++)
+    {
+        if (Size <= ARENA_BLOCK_SIZE(sizeClass))
+        {
+            break;
+        }
+    }
+    return sizeClass;
+}
+
+/**
+ * @brief Allocates the block from the arena.
+ *
+ * @details This is usable before and after ExitBootServices. The block is
+ *      taken from the free list of the current processor without a lock, and
+ *      from the shared free list or the unused part of the arena otherwise.
+ */
+static
+VOID*
+AllocateFromArena (
+    IN UINTN Size
+    )
+{
+    UINTN sizeClass;
+    UINTN interruptState;
+    PROCESSOR_CONTEXT* processor;
+    ARENA_FREE_LIST* freeList;
+    UINT32 offset;
+
+    sizeClass = GetArenaSizeClass(Size);
+    if ((Size == 0) || (sizeClass == ARENA_SIZE_CLASS_COUNT))
+    {
+        return NULL;
+    }
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    //
+    // Pop the block from the free list of the current processor. Only the
+    // processor updates the list, so no lock or interlocked operation is needed
+    // with the interrupt level raised.
+    //
+    processor = GetCurrentProcessorContext();
+    if ((processor != NULL) && (processor->ArenaCache[sizeClass].Count != 0))
+    {
+        freeList = &processor->ArenaCache[sizeClass];
+        offset = freeList->Head;
+        freeList->Head = *(UINT32*)(g_Arena.Base + offset);
+        freeList->Count--;
+        goto Exit;
+    }
+
+    //
+    // Otherwise, pop the block from the shared free list, or carve it out of
+    // the unused part of the arena.
+    //
+    AcquireSpinLock(&g_Arena.Lock);
+    freeList = &g_Arena.FreeLists[sizeClass];
+    if (freeList->Count != 0)
+    {
+        offset = freeList->Head;
+        freeList->Head = *(UINT32*)(g_Arena.Base + offset);
+        freeList->Count--;
+    }
+    else if (ARENA_BLOCK_SIZE(sizeClass) <= (g_Arena.Size - g_Arena.Used))
+    {
+        offset = g_Arena.Used;
+        g_Arena.Used += ARENA_BLOCK_SIZE(sizeClass);
+    }
+    else
+    {
+        offset = ARENA_INVALID_OFFSET;
+        g_Arena.Failures++;
+    }
+    ReleaseSpinLock(&g_Arena.Lock);
+
+Exit:
+    RestoreInterruptStateForNt(interruptState);
+    return (offset == ARENA_INVALID_OFFSET) ? NULL : (g_Arena.Base + offset);
+}
+
+/**
+ * @brief Frees the block allocated from the arena with the same size.
+ *
+ * @details The block goes to the free list of the current processor unless the
+ *      list already holds enough blocks.
+ */
+static
+VOID
+FreeToArena (
+    IN VOID* Buffer,
+    IN UINTN Size
+    )
+{
+    UINTN sizeClass;
+    UINTN interruptState;
+    PROCESSOR_CONTEXT* processor;
+    ARENA_FREE_LIST* freeList;
+    UINT32 offset;
+
+    sizeClass = GetArenaSizeClass(Size);
+    ASSERT(sizeClass < ARENA_SIZE_CLASS_COUNT);
+    ASSERT(((UINT8*)Buffer >= g_Arena.Base) &&
+           ((UINT8*)Buffer < g_Arena.Base + g_Arena.Used));
+
+    //
+    // Link blocks with the offsets rather than pointers, so that the free lists
+    // stay valid after relocation.
+    //
+    offset = (UINT32)((UINT8*)Buffer - g_Arena.Base);
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    processor = GetCurrentProcessorContext();
+    if ((processor != NULL) &&
+        (processor->ArenaCache[sizeClass].Count < ARENA_PROCESSOR_CACHE_LIMIT))
+    {
+        freeList = &processor->ArenaCache[sizeClass];
+        *(UINT32*)Buffer = freeList->Head;
+        freeList->Head = offset;
+        freeList->Count++;
+        goto Exit;
+    }
+
+    AcquireSpinLock(&g_Arena.Lock);
+    freeList = &g_Arena.FreeLists[sizeClass];
+    *(UINT32*)Buffer = freeList->Head;
+    freeList->Head = offset;
+    freeList->Count++;
+    ReleaseSpinLock(&g_Arena.Lock);
+
+Exit:
+    RestoreInterruptStateForNt(interruptState);
+}
+
+/**
+ * @brief Acquires the next sequence number of the log entries, along with the
+ *      index of the active log rings at that moment.
+ */
+static
+UINT64
+AcquireSequenceNumber (
+    OUT UINTN* RingIndex
+    )
+{
+    UINT64 current;
+
+    do
+    {
+        current = g_LogSequenceNumber;
+    } while (InterlockedCompareExchange64(&g_LogSequenceNumber,
+                                          current,
+                                          current + 1) != current);
+
+    *RingIndex = ((current & ACTIVE_LOG_RING_BIT) != 0) ? 1 : 0;
+    return (current & ~ACTIVE_LOG_RING_BIT);
+}
+
+/**
+ * @brief Discards the oldest records in the ring until the required size of
+ *      space becomes available.
+ */
+static
+VOID
+EvictLogRecords (
+    IN OUT LOG_RING* Ring,
+    IN UINTN RequiredSize
+    )
+{
+    CONST LOG_RECORD_HEADER* record;
+
+    ASSERT(RequiredSize <= Ring->Size);
+
+    while (((Ring->Head - Ring->Tail) + RequiredSize) > Ring->Size)
+    {
+        record = (CONST LOG_RECORD_HEADER*)&Ring->Buffer[Ring->Tail % Ring->Size];
+        if (record->RecordType == LogRecordEntry)
+        {
+            Ring->OverwrittenEntries++;
+        }
+        Ring->Tail += record->RecordSize;
+    }
+}
+
+/**
+ * @brief Grows the ring so that the required size of space becomes available.
+ *
+ * @details Rings grow by doubling up to the configured size. Records are moved
+ *      to the start of the new buffer without padding. The caller must ensure
+ *      that memory services are available and no one else accesses the ring.
+ */
+static
+BOOLEAN
+GrowLogRing (
+    IN OUT LOG_RING* Ring,
+    IN UINTN RequiredSize
+    )
+{
+    UINTN sizeInPages;
+    UINTN usedSize;
+    UINT8* buffer;
+    UINT64 offset;
+    UINTN newHead;
+    CONST LOG_RECORD_HEADER* record;
+
+    sizeInPages = EFI_SIZE_TO_PAGES(Ring->Size);
+    if (sizeInPages >= g_LogRingSizeInPages)
+    {
+        return FALSE;
+    }
+
+    usedSize = (UINTN)(Ring->Head - Ring->Tail) + RequiredSize;
+    do
+    {
+        sizeInPages *= 2;
+    } while (EFI_PAGES_TO_SIZE(sizeInPages) < usedSize);
+    sizeInPages = MIN(sizeInPages, g_LogRingSizeInPages);
+
+    buffer = AllocateRuntimePages(sizeInPages);
+    if (buffer == NULL)
+    {
+        return FALSE;
+    }
+
+    //
+    // The offsets restart from 0, which is fine as only their differences are
+    // meaningful.
+    //
+    newHead = 0;
+    for (offset = Ring->Tail; offset != Ring->Head; offset += record->RecordSize)
+    {
+        record = (CONST LOG_RECORD_HEADER*)&Ring->Buffer[offset % Ring->Size];
+        if (record->RecordType == LogRecordEntry)
+        {
+            CopyMem(&buffer[newHead], record, record->RecordSize);
+            newHead += record->RecordSize;
+        }
+    }
+
+    FreePages(Ring->Buffer, EFI_SIZE_TO_PAGES(Ring->Size));
+    Ring->Buffer = buffer;
+    Ring->Size = EFI_PAGES_TO_SIZE(sizeInPages);
+    Ring->Tail = 0;
+    Ring->Head = newHead;
+    return TRUE;
+}
+
+/**
+ * @brief Grows the active log ring of the current processor in advance, so
+ *      that the record of the required size fits without eviction.
+ *
+ * @details This is done before the sequence number is acquired, as memory
+ *      services must not be called with the interrupt level raised. The ring
+ *      is protected by TPL_NOTIFY, which is the highest level memory services
+ *      can be called at and which no caller of the variable services exceeds.
+ *      Rings may have been swapped by the time the record is added, in which
+ *      case the record is simply added to the other ring as usual. The grow is
+ *      announced through PendingSequenceNumber like adding an entry, so that
+ *      the drain command swapping the rings meanwhile does not copy from the
+ *      buffer being freed.
+ */
+static
+VOID
+PrepareLogRing (
+    IN UINTN RequiredSize
+    )
+{
+    EFI_TPL oldTpl;
+    PROCESSOR_CONTEXT* processor;
+    LOG_RING* ring;
+
+    //
+    // Memory services are not available after ExitBootServices, nor above
+    // TPL_NOTIFY. Rings are frozen even before ExitBootServices, as memory
+    // allocated after the OS loader got the memory map is not mapped by it.
+    //
+    if ((g_LogRingsFrozen != FALSE) ||
+        (EfiAtRuntime() != FALSE) ||
+        (EfiGetCurrentTpl() > TPL_NOTIFY))
+    {
+        return;
+    }
+
+    oldTpl = gBS->RaiseTPL(TPL_NOTIFY);
+
+    processor = GetCurrentProcessorContext();
+    if (processor != NULL)
+    {
+        //
+        // Announce 0 as the lower bound, so that the drain command swapping the
+        // rings after this waits for the grow to complete. The current sequence
+        // number is not enough, as no number is acquired to make it smaller
+        // than the drain limit. The compare-exchange orders the announcement
+        // and the read of the active ring. The drain command that swapped the
+        // rings before this may not wait, but then, the ring read here is the
+        // new active one, which it does not copy from.
+        //
+        InterlockedCompareExchange64(&processor->PendingSequenceNumber, MAX_UINT64, 0);
+        ring = &processor->LogRings[((g_LogSequenceNumber & ACTIVE_LOG_RING_BIT) != 0) ? 1 : 0];
+        if (((ring->Head - ring->Tail) + RequiredSize) > ring->Size)
+        {
+            GrowLogRing(ring, RequiredSize);
+        }
+        MemoryFence();
+        processor->PendingSequenceNumber = MAX_UINT64;
+    }
+
+    gBS->RestoreTPL(oldTpl);
+}
+
+/**
+ * @brief Stops log rings from growing any further.
+ *
+ * @details This is called on ReadyToBoot, and on BeforeExitBootServices for
+ *      the OS loader started without ReadyToBoot, for example, from the shell.
+ *      Both are signaled before the OS loader gets the memory map for
+ *      ExitBootServices.
+ */
+static
+VOID
+EFIAPI
+FreezeLogRings (
+    IN EFI_EVENT Event,
+    IN VOID* Context
+    )
+{
+    g_LogRingsFrozen = TRUE;
+}
+
+/**
+ * @brief Computes the FNV-1a hash of the variable name.
+ */
+static
+UINT32
+HashVariableName (
+    IN CONST CHAR16* VariableName
+    )
+{
+    UINT32 hash;
+
+    hash = 2166136261u;
+    for (CONST CHAR16* c = VariableName; *c != CHAR_NULL; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Checks whether the call matches the rule of the log filter.
+ */
+static
+BOOLEAN
+IsLogFilterRuleMatched (
+    IN CONST LOG_FILTER_ENTRY* Entry,
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes
+    )
+{
+    CONST LOG_FILTER_RULE* rule;
+
+    rule = &Entry->Rule;
+    if (((rule->Match & LOG_FILTER_MATCH_VENDOR_GUID) != 0) &&
+        ((VendorGuid == NULL) || (CompareGuid(VendorGuid, &rule->VendorGuid) == FALSE)))
+    {
+        return FALSE;
+    }
+
+    //
+    // The name is NULL if the call is invalid. Such a call matches no name rule.
+    //
+    if (((rule->Match & (LOG_FILTER_MATCH_NAME | LOG_FILTER_MATCH_NAME_PREFIX)) != 0) &&
+        (VariableName == NULL))
+    {
+        return FALSE;
+    }
+
+    if (((rule->Match & LOG_FILTER_MATCH_NAME) != 0) &&
+        (StrnCmp(VariableName, rule->Name, ARRAY_SIZE(rule->Name)) != 0))
+    {
+        return FALSE;
+    }
+
+    if (((rule->Match & LOG_FILTER_MATCH_NAME_PREFIX) != 0) &&
+        (StrnCmp(VariableName, rule->Name, Entry->NameLength) != 0))
+    {
+        return FALSE;
+    }
+
+    if (((rule->Match & LOG_FILTER_MATCH_ATTRIBUTES) != 0) &&
+        ((Attributes & rule->AttributesMask) != rule->AttributesValue))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Applies the action of the matched rule of the log filter.
+ *
+ * @details Each of the policy rule indexes is updated to the lowest index of
+ *      the matched include rules that specify the policy.
+ */
+static
+VOID
+ApplyLogFilterRule (
+    IN CONST LOG_FILTER* Filter,
+    IN UINT32 RuleIndex,
+    IN OUT LOG_FILTER_RESULT* Result
+    )
+{
+    CONST LOG_FILTER_RULE* rule;
+
+    rule = &Filter->Entries[RuleIndex].Rule;
+    if (rule->Action == LogFilterExclude)
+    {
+        Result->Excluded = TRUE;
+        return;
+    }
+
+    Result->Included = TRUE;
+    if ((rule->CaptureMode != CaptureModeDefault) &&
+        (RuleIndex < Result->CaptureRuleIndex))
+    {
+        Result->CaptureRuleIndex = RuleIndex;
+    }
+    if ((rule->SampleInterval > 1) &&
+        (RuleIndex < Result->SamplingRuleIndex))
+    {
+        Result->SamplingRuleIndex = RuleIndex;
+    }
+    if ((rule->RateLimit != 0) &&
+        (RuleIndex < Result->RateLimitRuleIndex))
+    {
+        Result->RateLimitRuleIndex = RuleIndex;
+    }
+}
+
+/**
+ * @brief Evaluates the log filter for the call.
+ *
+ * @details The filter may be modified concurrently. The caller discards the
+ *      result in that case, but every index is still checked so that the
+ *      evaluation does not go out of bounds.
+ */
+static
+BOOLEAN
+EvaluateLogFilter (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    OUT LOG_POLICY* Policy
+    )
+{
+    CONST LOG_FILTER* filter;
+    CONST LOG_FILTER_SLOT* slot;
+    CONST LOG_FILTER_RULE* rule;
+    LOG_FILTER_RESULT result;
+    UINT32 ruleIndex;
+    UINT32 hash;
+
+    ZeroMem(Policy, sizeof(*Policy));
+
+    filter = &g_LogFilter;
+    if (filter->RuleCount == 0)
+    {
+        return TRUE;
+    }
+
+    result.Included = (filter->IncludeRuleCount == 0);
+    result.Excluded = FALSE;
+    result.CaptureRuleIndex = MAX_UINT32;
+    result.SamplingRuleIndex = MAX_UINT32;
+    result.RateLimitRuleIndex = MAX_UINT32;
+
+    //
+    // Check the rules for the exact name. Probe until the empty slot.
+    //
+    hash = (VariableName == NULL) ? 0 : HashVariableName(VariableName);
+    for (UINTN i = 0; (VariableName != NULL) && (i < LOG_FILTER_HASH_SIZE); i++)
+    {
+        slot = &filter->Slots[(hash + i) & (LOG_FILTER_HASH_SIZE - 1)];
+        if ((slot->RuleIndex == 0) || (slot->RuleIndex > MAX_LOG_FILTER_RULES))
+        {
+            break;
+        }
+
+        ruleIndex = slot->RuleIndex - 1;
+        if ((slot->Hash != hash) ||
+            (IsLogFilterRuleMatched(&filter->Entries[ruleIndex],
+                                    VariableName,
+                                    VendorGuid,
+                                    Attributes) == FALSE))
+        {
+            continue;
+        }
+
+        ApplyLogFilterRule(filter, ruleIndex, &result);
+    }
+
+    //
+    // Check the rest of the rules one by one.
+    //
+    for (UINTN i = 0; i < MIN(filter->UnhashedRuleCount, MAX_LOG_FILTER_RULES); i++)
+    {
+        ruleIndex = filter->UnhashedRules[i];
+        if ((ruleIndex >= MAX_LOG_FILTER_RULES) ||
+            (IsLogFilterRuleMatched(&filter->Entries[ruleIndex],
+                                    VariableName,
+                                    VendorGuid,
+                                    Attributes) == FALSE))
+        {
+            continue;
+        }
+
+        ApplyLogFilterRule(filter, ruleIndex, &result);
+    }
+
+    if (result.CaptureRuleIndex < MAX_LOG_FILTER_RULES)
+    {
+        rule = &filter->Entries[result.CaptureRuleIndex].Rule;
+        Policy->CaptureMode = (CAPTURE_MODE)rule->CaptureMode;
+        Policy->CaptureSize = rule->CaptureSize;
+    }
+    if (result.SamplingRuleIndex < MAX_LOG_FILTER_RULES)
+    {
+        rule = &filter->Entries[result.SamplingRuleIndex].Rule;
+        Policy->SampleInterval = rule->SampleInterval;
+    }
+    if (result.RateLimitRuleIndex < MAX_LOG_FILTER_RULES)
+    {
+        rule = &filter->Entries[result.RateLimitRuleIndex].Rule;
+        Policy->RateLimit = rule->RateLimit;
+        Policy->RateBurst = rule->RateBurst;
+    }
+
+    return ((result.Included != FALSE) && (result.Excluded == FALSE));
+}
+
+/**
+ * @brief Checks whether the call should be logged according to the log filter,
+ *      and returns how to log the call if so.
+ */
+static
+BOOLEAN
+IsLogFilterPassed (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    OUT LOG_POLICY* Policy
+    )
+{
+    UINT32 version;
+    BOOLEAN passed;
+
+    //
+    // Evaluate the filter until it is not modified during the evaluation.
+    //
+    do
+    {
+        version = g_LogFilterVersion;
+        MemoryFence();
+        passed = EvaluateLogFilter(VariableName, VendorGuid, Attributes, Policy);
+        MemoryFence();
+    } while (((version & 1) != 0) || (version != g_LogFilterVersion));
+
+    //
+    // Follow the global capture mode unless the rule specifies it.
+    //
+    if (Policy->CaptureMode == CaptureModeDefault)
+    {
+        Policy->CaptureMode = g_CaptureMode;
+        Policy->CaptureSize = g_CaptureSize;
+    }
+    if (Policy->CaptureMode == CaptureModeDefault)
+    {
+        Policy->CaptureMode = CaptureModeFull;
+    }
+
+    return passed;
+}
+
+/**
+ * @brief Checks whether the call should be logged according to the sampling
+ *      and the rate limit of the variable.
+ *
+ * @details The rate limit is a token bucket implemented as the generic cell
+ *      rate algorithm: NextLogTsc advances by the interval of the rate on each
+ *      logged call, and the call is suppressed if it would advance beyond the
+ *      burst. The caller must have raised the interrupt level.
+ */
+static
+BOOLEAN
+IsLogSampled (
+    IN OUT VARIABLE_STATISTICS* Statistics,
+    IN CONST LOG_POLICY* Policy,
+    IN UINT64 Tsc,
+    OUT UINT32* SuppressedEntries
+    )
+{
+    BOOLEAN sampled;
+    UINT64 interval;
+    UINT64 nextLogTsc;
+
+    sampled = TRUE;
+    *SuppressedEntries = 0;
+
+    AcquireSpinLock(&Statistics->Lock);
+
+    if (Policy->SampleInterval > 1)
+    {
+        Statistics->SampleCounter++;
+        if ((Statistics->SampleCounter % Policy->SampleInterval) != 0)
+        {
+            sampled = FALSE;
+        }
+    }
+
+    if ((sampled != FALSE) &&
+        (Policy->RateLimit != 0) &&
+        (g_LogBufferHeader.TscFrequency != 0))
+    {
+        interval = DivU64x32(g_LogBufferHeader.TscFrequency, Policy->RateLimit);
+        nextLogTsc = MAX(Statistics->NextLogTsc, Tsc);
+        if ((nextLogTsc - Tsc) > MultU64x32(interval, MAX(Policy->RateBurst, 1) - 1))
+        {
+            sampled = FALSE;
+        }
+        else
+        {
+            Statistics->NextLogTsc = nextLogTsc + interval;
+        }
+    }
+
+    //
+    // Report the number of suppressed calls with the next logged call.
+    //
+    if (sampled == FALSE)
+    {
+        Statistics->SuppressedEntries++;
+        Statistics->TotalSuppressedEntries++;
+    }
+    else
+    {
+        *SuppressedEntries = Statistics->SuppressedEntries;
+        Statistics->SuppressedEntries = 0;
+    }
+
+    ReleaseSpinLock(&Statistics->Lock);
+    return sampled;
+}
+
+/**
+ * @brief Computes the 64-bit FNV-1a digest of the data.
+ *
+ * @details The digest is not collision-resistant, so it only tells that the
+ *      data may be the same. Anything that must not confuse different data
+ *      compares the data itself.
+ */
+static
+UINT64
+DigestData (
+    IN CONST VOID* Data OPTIONAL,
+    IN UINTN DataSize
+    )
+{
+    CONST UINT8* bytes;
+    UINT64 digest;
+
+    bytes = (CONST UINT8*)Data;
+    digest = 14695981039346656037ull;
+    for (UINTN i = 0; i < DataSize; i++)
+    {
+        digest ^= bytes[i];
+        digest *= 1099511628211ull;
+    }
+    return digest;
+}
+
+/**
+ * @brief Computes the FNV-1a hash of the pair of the variable name and the
+ *      vendor GUID, as stored in the variable name table.
+ */
+static
+UINT32
+HashVariable (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid
+    )
+{
+    UINT32 hash;
+    CONST UINT8* guidBytes;
+
+    hash = 2166136261u;
+    for (UINTN i = 0; i < ARRAY_SIZE(g_VariableNames->Records[0].VariableName) - 1; i++)
+    {
+        if (VariableName[i] == CHAR_NULL)
+        {
+            break;
+        }
+        hash ^= VariableName[i];
+        hash *= 16777619u;
+    }
+
+    guidBytes = (CONST UINT8*)VendorGuid;
+    for (UINTN i = 0; i < sizeof(*VendorGuid); i++)
+    {
+        hash ^= guidBytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Checks whether the name of the variable is too long to be kept in the
+ *      variable name table as is.
+ *
+ * @details Such names are truncated in the table, so different variables whose
+ *      names share the prefix get the same ID. Anything that must not confuse
+ *      variables, such as caching, must skip them.
+ */
+static
+BOOLEAN
+IsVariableNameTruncated (
+    IN CONST CHAR16* VariableName
+    )
+{
+    return (StrnLenS(VariableName, ARRAY_SIZE(g_VariableNames->Records[0].VariableName)) >=
+            (ARRAY_SIZE(g_VariableNames->Records[0].VariableName) - 1));
+}
+
+/**
+ * @brief Looks up the ID of the variable in the variable name table.
+ */
+static
+UINT32
+LookUpVariableId (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Hash
+    )
+{
+    CONST VARIABLE_NAME_SLOT* slot;
+    CONST VARIABLE_NAME_RECORD* record;
+    UINT32 variableId;
+
+    for (UINTN i = 0; i < VARIABLE_NAME_HASH_SIZE; i++)
+    {
+        slot = &g_VariableNames->Slots[(Hash + i) & (VARIABLE_NAME_HASH_SIZE - 1)];
+        variableId = slot->VariableId;
+        if (variableId == VARIABLE_ID_UNKNOWN)
+        {
+            break;
+        }
+
+        record = &g_VariableNames->Records[variableId - 1];
+        if ((slot->Hash == Hash) &&
+            (CompareGuid(&record->VendorGuid, VendorGuid) != FALSE) &&
+            (StrnCmp(record->VariableName,
+                     VariableName,
+                     ARRAY_SIZE(record->VariableName) - 1) == 0))
+        {
+            return variableId;
+        }
+    }
+    return VARIABLE_ID_UNKNOWN;
+}
+
+/**
+ * @brief Returns the ID of the variable, registering it if not yet.
+ *
+ * @details The caller must have raised the interrupt level.
+ */
+static
+UINT32
+GetVariableId (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid
+    )
+{
+    UINT32 hash;
+    UINT32 variableId;
+    UINTN slotIndex;
+    VARIABLE_NAME_RECORD* record;
+
+    //
+    // The call with the NULL name or GUID is left for the original service to
+    // reject.
+    //
+    if ((VariableName == NULL) || (VendorGuid == NULL))
+    {
+        return VARIABLE_ID_UNKNOWN;
+    }
+
+    hash = HashVariable(VariableName, VendorGuid);
+    variableId = LookUpVariableId(VariableName, VendorGuid, hash);
+    if (variableId != VARIABLE_ID_UNKNOWN)
+    {
+        goto Exit;
+    }
+
+    AcquireSpinLock(&g_VariableNamesLock);
+
+    //
+    // Look up again as another processor may have registered it meanwhile.
+    //
+    variableId = LookUpVariableId(VariableName, VendorGuid, hash);
+    if ((variableId != VARIABLE_ID_UNKNOWN) ||
+        (g_VariableNames->Count == MAX_VARIABLE_NAMES))
+    {
+        goto ExitLocked;
+    }
+
+    //
+    // Write the record, then publish it through the slot. The table never gets
+    // full as it has more slots than the maximum number of records.
+    //
+    variableId = g_VariableNames->Count + 1;
+    InitializeSpinLock(&g_VariableNames->Statistics[variableId - 1].Lock);
+
+    record = &g_VariableNames->Records[variableId - 1];
+    record->VariableId = variableId;
+    record->VendorGuid = *VendorGuid;
+    StrnCpyS(record->VariableName,
+             ARRAY_SIZE(record->VariableName),
+             VariableName,
+             ARRAY_SIZE(record->VariableName) - 1);
+
+    slotIndex = hash & (VARIABLE_NAME_HASH_SIZE - 1);
+    while (g_VariableNames->Slots[slotIndex].VariableId != VARIABLE_ID_UNKNOWN)
+    {
+        slotIndex = (slotIndex + 1) & (VARIABLE_NAME_HASH_SIZE - 1);
+    }
+    g_VariableNames->Slots[slotIndex].Hash = hash;
+    MemoryFence();
+    g_VariableNames->Slots[slotIndex].VariableId = variableId;
+    g_VariableNames->Count = variableId;
+
+ExitLocked:
+    ReleaseSpinLock(&g_VariableNamesLock);
+
+Exit:
+    return variableId;
+}
+
+/**
+ * @brief Checks whether the shadow digest can be kept for the SetVariable
+ *      attributes.
+ *
+ * @details Appending and authenticated writes carry data different from the
+ *      resulting value of the variable.
+ */
+static
+BOOLEAN
+IsShadowableWrite (
+    IN UINT32 Attributes
+    )
+{
+    return ((Attributes & (EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+                           EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS |
+                           EFI_VARIABLE_APPEND_WRITE |
+                           EFI_VARIABLE_ENHANCED_AUTHENTICATED_ACCESS)) == 0);
+}
+
+/**
+ * @brief Checks whether the current value of the variable is the same as the
+ *      attributes and data to write, by reading it from the original service.
+ *
+ * @details Data larger than READ_CACHE_MAX_DATA_SIZE is never considered the
+ *      same, as it does not fit in the buffer on the stack.
+ */
+static
+BOOLEAN
+IsCurrentValueSame (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN CONST VOID* Data
+    )
+{
+    EFI_STATUS status;
+    UINT8 buffer[READ_CACHE_MAX_DATA_SIZE];
+    UINTN bufferSize;
+    UINT32 attributes;
+
+    if (DataSize > sizeof(buffer))
+    {
+        return FALSE;
+    }
+
+    bufferSize = sizeof(buffer);
+    status = g_GetVariable((CHAR16*)VariableName,
+                           (EFI_GUID*)VendorGuid,
+                           &attributes,
+                           &bufferSize,
+                           buffer);
+    return ((status == EFI_SUCCESS) &&
+            (attributes == Attributes) &&
+            (bufferSize == DataSize) &&
+            (CompareMem(buffer, Data, DataSize) == 0));
+}
+
+/**
+ * @brief Compares the SetVariable call with the shadow digest of the variable,
+ *      and invalidates the digest until the call completes unless the call is
+ *      short-circuited.
+ *
+ * @details The matching digest is enough to count the call as redundant. The
+ *      call is short-circuited only if the data read back from the original
+ *      service is also the same, and the variable was not written meanwhile.
+ *
+ * @return TRUE if the call writes the same value as the current one.
+ */
+static
+BOOLEAN
+BeginShadowUpdate (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN CONST VOID* Data OPTIONAL,
+    OUT SHADOW_UPDATE* Update
+    )
+{
+    UINTN interruptState;
+    UINT32 variableId;
+    VARIABLE_STATISTICS* statistics;
+    BOOLEAN redundant;
+    BOOLEAN skippable;
+    UINT32 generation;
+
+    ZeroMem(Update, sizeof(*Update));
+    redundant = FALSE;
+
+    //
+    // Variables whose names are truncated share the shadow digest with others,
+    // and are never considered redundant. Neither is the call with invalid
+    // data, which is left for the original service to reject.
+    //
+    if (((g_MonitorFlags & (MONITOR_FLAG_DETECT_REDUNDANT_WRITES |
+                            MONITOR_FLAG_SKIP_REDUNDANT_WRITES)) == 0) ||
+        (VariableName == NULL) ||
+        (IsVariableNameTruncated(VariableName) != FALSE) ||
+        ((Data == NULL) && (DataSize != 0)))
+    {
+        goto Exit;
+    }
+
+    Update->Digest = DigestData(Data, DataSize);
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    variableId = GetVariableId(VariableName, VendorGuid);
+    if (variableId == VARIABLE_ID_UNKNOWN)
+    {
+        goto ExitRestore;
+    }
+
+    statistics = &g_VariableNames->Statistics[variableId - 1];
+    AcquireSpinLock(&statistics->Lock);
+
+    redundant = ((statistics->ShadowValid != FALSE) &&
+                 (IsShadowableWrite(Attributes) != FALSE) &&
+                 (DataSize != 0) &&
+                 (Attributes == statistics->ShadowAttributes) &&
+                 (DataSize == statistics->ShadowDataSize) &&
+                 (Update->Digest == statistics->ShadowDigest));
+    if (redundant != FALSE)
+    {
+        statistics->RedundantWrites++;
+        statistics->RedundantBytes += DataSize;
+    }
+    skippable = ((redundant != FALSE) &&
+                 ((g_MonitorFlags & MONITOR_FLAG_SKIP_REDUNDANT_WRITES) != 0));
+    generation = statistics->ShadowGeneration;
+
+    //
+    // The digests may collide. Compare the data itself before short-circuiting
+    // the call, outside the lock and at the interrupt level of the caller, as
+    // the original service is called.
+    //
+    if (skippable != FALSE)
+    {
+        ReleaseSpinLockForNt(&statistics->Lock, interruptState);
+        skippable = IsCurrentValueSame(VariableName, VendorGuid, Attributes, DataSize, Data);
+        AcquireSpinLockForNt(&statistics->Lock, &interruptState);
+        Update->Skipped = ((skippable != FALSE) &&
+                           (statistics->ShadowValid != FALSE) &&
+                           (generation == statistics->ShadowGeneration));
+    }
+
+    //
+    // The variable keeps the current value if the call is short-circuited.
+    // Otherwise, the value is unknown until the call completes.
+    //
+    if (Update->Skipped == FALSE)
+    {
+        Update->VariableId = variableId;
+        Update->Exclusive = (statistics->PendingWrites == 0);
+        statistics->PendingWrites++;
+        statistics->ShadowGeneration++;
+        statistics->ShadowValid = FALSE;
+        Update->Generation = statistics->ShadowGeneration;
+    }
+
+    ReleaseSpinLock(&statistics->Lock);
+
+ExitRestore:
+    RestoreInterruptStateForNt(interruptState);
+
+Exit:
+    return redundant;
+}
+
+/**
+ * @brief Updates the shadow digest of the variable with the result of the
+ *      SetVariable call.
+ *
+ * @details The digest is kept only if no other SetVariable call for the
+ *      variable overlapped with this call, as the order the calls took effect
+ *      is unknown otherwise.
+ */
+static
+VOID
+EndShadowUpdate (
+    IN CONST SHADOW_UPDATE* Update,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN EFI_STATUS Status
+    )
+{
+    UINTN interruptState;
+    VARIABLE_STATISTICS* statistics;
+
+    if (Update->VariableId == VARIABLE_ID_UNKNOWN)
+    {
+        return;
+    }
+
+    statistics = &g_VariableNames->Statistics[Update->VariableId - 1];
+    AcquireSpinLockForNt(&statistics->Lock, &interruptState);
+
+    if ((Update->Exclusive != FALSE) &&
+        (Update->Generation == statistics->ShadowGeneration) &&
+        (Status == EFI_SUCCESS) &&
+        (IsShadowableWrite(Attributes) != FALSE) &&
+        (Attributes != 0) &&
+        (DataSize != 0))
+    {
+        statistics->ShadowValid = TRUE;
+        statistics->ShadowAttributes = Attributes;
+        statistics->ShadowDataSize = DataSize;
+        statistics->ShadowDigest = Update->Digest;
+    }
+
+    ASSERT(statistics->PendingWrites != 0);
+    statistics->PendingWrites--;
+    statistics->ShadowGeneration++;
+
+    ReleaseSpinLockForNt(&statistics->Lock, interruptState);
+}
+
+/**
+ * @brief Invalidates the shadow digests of all variables.
+ */
+static
+VOID
+InvalidateShadowDigests (
+    VOID
+    )
+{
+    UINTN interruptState;
+    VARIABLE_STATISTICS* statistics;
+
+    for (UINT32 i = 0; i < g_VariableNames->Count; i++)
+    {
+        statistics = &g_VariableNames->Statistics[i];
+        AcquireSpinLockForNt(&statistics->Lock, &interruptState);
+        statistics->ShadowValid = FALSE;
+        statistics->ShadowGeneration++;
+        ReleaseSpinLockForNt(&statistics->Lock, interruptState);
+    }
+}
+
+/**
+ * @brief Returns the shadow generation of the variable before reading it, or
+ *      0 if the value read cannot be used for the shadow digest.
+ */
+static
+UINT32
+BeginShadowRead (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    OUT UINT32* VariableId
+    )
+{
+    UINT32 generation;
+    CONST VARIABLE_STATISTICS* statistics;
+
+    *VariableId = VARIABLE_ID_UNKNOWN;
+    if (((g_MonitorFlags & (MONITOR_FLAG_DETECT_REDUNDANT_WRITES |
+                            MONITOR_FLAG_SKIP_REDUNDANT_WRITES)) == 0) ||
+        (VariableName == NULL) ||
+        (IsVariableNameTruncated(VariableName) != FALSE))
+    {
+        return 0;
+    }
+
+    *VariableId = LookUpVariableId(VariableName,
+                                   VendorGuid,
+                                   HashVariable(VariableName, VendorGuid));
+    if (*VariableId == VARIABLE_ID_UNKNOWN)
+    {
+        return 0;
+    }
+
+    statistics = &g_VariableNames->Statistics[*VariableId - 1];
+    generation = statistics->ShadowGeneration;
+    MemoryFence();
+    return generation;
+}
+
+/**
+ * @brief Updates the shadow digest of the variable with the value read by the
+ *      GetVariable call, unless SetVariable was called for the variable during
+ *      the read.
+ */
+static
+VOID
+EndShadowRead (
+    IN UINT32 VariableId,
+    IN UINT32 Generation,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN CONST VOID* Data
+    )
+{
+    UINTN interruptState;
+    VARIABLE_STATISTICS* statistics;
+    UINT64 digest;
+
+    if (VariableId == VARIABLE_ID_UNKNOWN)
+    {
+        return;
+    }
+
+    digest = DigestData(Data, DataSize);
+
+    statistics = &g_VariableNames->Statistics[VariableId - 1];
+    AcquireSpinLockForNt(&statistics->Lock, &interruptState);
+
+    if ((Generation == statistics->ShadowGeneration) &&
+        (statistics->PendingWrites == 0))
+    {
+        statistics->ShadowValid = TRUE;
+        statistics->ShadowAttributes = Attributes;
+        statistics->ShadowDataSize = DataSize;
+        statistics->ShadowDigest = digest;
+    }
+
+    ReleaseSpinLockForNt(&statistics->Lock, interruptState);
+}
+
+/**
+ * @brief Returns the index of the latency histogram bucket for the ticks.
+ */
+static
+UINTN
+GetLatencyBucket (
+    IN UINT64 Ticks
+    )
+{
+    INTN highBit;
+
+    highBit = HighBitSet64(Ticks);
+    if (highBit < 0)
+    {
+        return 0;
+    }
+    return MIN((UINTN)highBit, LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * @brief Records the call into the aggregate statistics and the latency
+ *      histograms.
+ */
+static
+VOID
+RecordCallStatistics (
+    IN VARIABLE_CALLBACK_TYPE CallbackType,
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN EFI_STATUS Status,
+    IN UINT64 ServiceTicks,
+    IN UINT64 HookTicks,
+    IN UINT64 CallbackTicks
+    )
+{
+    UINTN interruptState;
+    PROCESSOR_CONTEXT* processor;
+    UINT32 variableId;
+    UINTN serviceBucket;
+    VARIABLE_STATISTICS* statistics;
+
+    serviceBucket = GetLatencyBucket(ServiceTicks);
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    processor = GetCurrentProcessorContext();
+    if (processor != NULL)
+    {
+        processor->Latency.Service[CallbackType][serviceBucket]++;
+        processor->Latency.Hook[CallbackType][GetLatencyBucket(HookTicks)]++;
+        processor->Latency.Callback[CallbackType][GetLatencyBucket(CallbackTicks)]++;
+    }
+
+    //
+    // The per-variable statistics are only for GetVariable and SetVariable.
+    //
+    if ((CallbackType != VariableCallbackGet) && (CallbackType != VariableCallbackSet))
+    {
+        goto Exit;
+    }
+
+    variableId = GetVariableId(VariableName, VendorGuid);
+    if (variableId == VARIABLE_ID_UNKNOWN)
+    {
+        goto Exit;
+    }
+
+    statistics = &g_VariableNames->Statistics[variableId - 1];
+    InterlockedIncrement(&statistics->ServiceLatency[CallbackType][serviceBucket]);
+
+    AcquireSpinLock(&statistics->Lock);
+    if (CallbackType == VariableCallbackGet)
+    {
+        statistics->GetCount++;
+    }
+    else
+    {
+        statistics->SetCount++;
+    }
+
+    if (EFI_ERROR(Status))
+    {
+        statistics->ErrorCount++;
+    }
+    else if (CallbackType == VariableCallbackGet)
+    {
+        statistics->BytesRead += DataSize;
+    }
+    else
+    {
+        statistics->BytesWritten += DataSize;
+        statistics->LastAttributes = Attributes;
+    }
+    statistics->LastStatus = Status;
+    ReleaseSpinLock(&statistics->Lock);
+
+Exit:
+    RestoreInterruptStateForNt(interruptState);
+}
+
+/**
+ * @brief Adds the new log entry to the active log ring of the current processor.
+ *
+ * @details When the ring does not have enough space for the entry, the entry
+ *      is discarded or the oldest entries are overwritten according to the
+ *      current log mode.
+ */
+static
+VOID
+AddLogEntryVariable(
+    VARIABLE_CALLBACK_TYPE CallbackType,
+    CONST CHAR16* VariableName,
+    CONST EFI_GUID* VendorGuid,
+    UINT32 Attributes,
+    UINTN DataSize,
+    CONST VOID* Data OPTIONAL,
+    EFI_STATUS Status,
+    UINT64 TscStart,
+    UINT64 TscEnd,
+    UINT16 Flags
+    )
+{
+    UINTN interruptState;
+    PROCESSOR_CONTEXT* processor;
+    LOG_RING* ring;
+    UINTN ringIndex;
+    UINT64 sequenceNumber;
+    UINTN offset;
+    UINTN paddingSize;
+    UINTN recordSize;
+    UINTN requiredSize;
+    UINT64 usedSize;
+    LOG_RECORD_HEADER* record;
+    VARIABLE_LOG_ENTRY* entry;
+    UINT32 variableId;
+    LOG_POLICY policy;
+    UINT32 suppressedEntries;
+    CONST VOID* capturedData;
+    UINTN capturedSize;
+    UINT64 digest;
+
+    //
+    // Only the aggregate statistics are updated in this mode.
+    //
+    if (g_LogMode == LogModeAggregateOnly)
+    {
+        return;
+    }
+
+    //
+    // Check the log filter first. The call filtered out does not consume a
+    // sequence number, and hence, is not reported as lost either.
+    //
+    if (IsLogFilterPassed(VariableName, VendorGuid, Attributes, &policy) == FALSE)
+    {
+        return;
+    }
+
+    //
+    // Determine the data to copy into the log, which bounds the cost of
+    // logging large variables unless the full capture is requested. The digest
+    // is computed only once the call turns out not to be suppressed.
+    //
+    capturedData = Data;
+    switch (policy.CaptureMode)
+    {
+    case CaptureModeNone:
+        capturedSize = 0;
+        break;
+
+    case CaptureModeTruncate:
+        capturedSize = MIN(DataSize, (UINTN)policy.CaptureSize);
+        break;
+
+    case CaptureModeDigest:
+        capturedData = &digest;
+        capturedSize = sizeof(digest);
+        break;
+
+    default:
+        capturedSize = DataSize;
+        break;
+    }
+
+    //
+    // Grow the ring in advance if the free space is too small for the record.
+    // This is possible only while boot services are available.
+    //
+    recordSize = ALIGN_VALUE(sizeof(*record) + sizeof(*entry) + capturedSize, 0x10);
+    if (capturedSize <= EFI_PAGES_TO_SIZE(g_LogRingSizeInPages))
+    {
+        PrepareLogRing(recordSize);
+    }
+
+    //
+    // Raise the interrupt level so that this thread keeps running on the same
+    // processor, which is the only producer of its log rings.
+    //
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    //
+    // Every processor gets a context as long as the MP Services protocol
+    // reported the correct number of processors.
+    //
+    processor = GetCurrentProcessorContext();
+    if (processor == NULL)
+    {
+        goto Exit;
+    }
+
+    //
+    // Resolve the ID of the variable before acquiring the sequence number, as
+    // it may wait for the lock.
+    //
+    variableId = GetVariableId(VariableName, VendorGuid);
+
+    //
+    // Apply the sampling and the rate limit. The suppressed call does not
+    // consume a sequence number either.
+    //
+    suppressedEntries = 0;
+    if ((variableId != VARIABLE_ID_UNKNOWN) &&
+        ((policy.SampleInterval > 1) || (policy.RateLimit != 0)) &&
+        (IsLogSampled(&g_VariableNames->Statistics[variableId - 1],
+                      &policy,
+                      TscEnd,
+                      &suppressedEntries) == FALSE))
+    {
+        goto Exit;
+    }
+
+    if (policy.CaptureMode == CaptureModeDigest)
+    {
+        digest = DigestData(Data, DataSize);
+    }
+
+    //
+    // Announce the lower bound of the sequence number before acquiring it, so
+    // that the drain command can wait for this entry if the rings are being
+    // swapped. The compare-exchange in AcquireSequenceNumber orders the two.
+    //
+    processor->PendingSequenceNumber = (g_LogSequenceNumber & ~ACTIVE_LOG_RING_BIT);
+    sequenceNumber = AcquireSequenceNumber(&ringIndex);
+    ring = &processor->LogRings[ringIndex];
+
+    if (capturedSize > EFI_PAGES_TO_SIZE(g_LogRingSizeInPages))
+    {
+        ring->DroppedEntries++;
+        goto Published;
+    }
+
+    //
+    // Records are never split at the end of the ring. If the rest of the ring
+    // is too small for the record, fill it with padding and wrap around.
+    //
+    offset = (UINTN)(ring->Head % ring->Size);
+    paddingSize = 0;
+    if ((ring->Size - offset) < recordSize)
+    {
+        paddingSize = ring->Size - offset;
+    }
+
+    //
+    // Make space by overwriting the oldest records if configured so. The entry
+    // is discarded if the space is still not enough, or the entry does not fit
+    // in the ring even if it is empty.
+    //
+    requiredSize = paddingSize + recordSize;
+    if (requiredSize > ring->Size)
+    {
+        ring->DroppedEntries++;
+        goto Published;
+    }
+
+    if (g_LogMode == LogModeOverwriteOldest)
+    {
+        EvictLogRecords(ring, requiredSize);
+    }
+
+    usedSize = (ring->Head - ring->Tail) + requiredSize;
+    if (usedSize > ring->Size)
+    {
+        ring->DroppedEntries++;
+        goto Published;
+    }
+
+    if (usedSize > ring->HighWaterMark)
+    {
+        ring->HighWaterMark = usedSize;
+    }
+
+    if (paddingSize != 0)
+    {
+        record = (LOG_RECORD_HEADER*)&ring->Buffer[offset];
+        record->RecordSize = (UINT32)paddingSize;
+        record->RecordType = LogRecordPadding;
+        record->SequenceNumber = 0;
+        offset = 0;
+    }
+
+    //
+    // Copy parameters to the log ring.
+    //
+    record = (LOG_RECORD_HEADER*)&ring->Buffer[offset];
+    record->RecordSize = (UINT32)recordSize;
+    record->RecordType = LogRecordEntry;
+    record->SequenceNumber = sequenceNumber;
+
+    entry = (VARIABLE_LOG_ENTRY*)(record + 1);
+    entry->EntrySize = (UINT32)(recordSize - sizeof(*record));
+    entry->CallbackType = (UINT8)CallbackType;
+    entry->CaptureMode = (UINT8)policy.CaptureMode;
+    entry->Flags = Flags;
+    entry->ApicId = processor->ApicId;
+    entry->VariableId = variableId;
+    entry->SequenceNumber = sequenceNumber;
+    entry->TscStart = TscStart;
+    entry->TscEnd = TscEnd;
+    entry->Status = Status;
+    entry->Attributes = Attributes;
+    entry->DataSize = (UINT32)MIN(DataSize, MAX_UINT32);
+    entry->CapturedSize = (UINT32)capturedSize;
+    entry->SuppressedEntries = suppressedEntries;
+    CopyMem(entry->Data, capturedData, capturedSize);
+
+    ring->Head += requiredSize;
+
+Published:
+    //
+    // The ring contents must become visible before the drain command stops
+    // waiting for this processor.
+    //
+    MemoryFence();
+    processor->PendingSequenceNumber = MAX_UINT64;
+
+Exit:
+    RestoreInterruptStateForNt(interruptState);
+
+    DebugPrint(DEBUG_VERBOSE,
+               "%c: %g Size=%08x %s: %r\n",
+               VARIABLE_CALLBACK_TYPE_LETTERS[CallbackType],
+               VendorGuid,
+               DataSize,
+               VariableName,
+               Status);
+}
+
+/**
+ * @brief Removes the entry from the read cache.
+ *
+ * @details The caller must hold the lock of the read cache.
+ */
+static
+VOID
+RemoveReadCacheEntry (
+    IN OUT READ_CACHE_ENTRY* Entry
+    )
+{
+    ASSERT(Entry->VariableId != VARIABLE_ID_UNKNOWN);
+
+    g_ReadCache->EntryIndexes[Entry->VariableId - 1] = 0;
+    Entry->VariableId = VARIABLE_ID_UNKNOWN;
+}
+
+/**
+ * @brief Checks whether the variable is recorded as not found in the negative
+ *      cache.
+ *
+ * @details The caller must hold the lock of the read cache.
+ */
+static
+BOOLEAN
+IsNotFoundCached (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Hash
+    )
+{
+    CONST NEGATIVE_CACHE_ENTRY* entry;
+
+    entry = &g_ReadCache->NotFound[Hash & (NEGATIVE_CACHE_ENTRY_COUNT - 1)];
+    return ((entry->VariableName[0] != CHAR_NULL) &&
+            (entry->Hash == Hash) &&
+            (CompareGuid(&entry->VendorGuid, VendorGuid) != FALSE) &&
+            (StrCmp(entry->VariableName, VariableName) == 0));
+}
+
+/**
+ * @brief Removes the entry from the negative cache.
+ *
+ * @details The caller must hold the lock of the read cache.
+ */
+static
+VOID
+RemoveNotFoundEntry (
+    IN OUT NEGATIVE_CACHE_ENTRY* Entry
+    )
+{
+    if (Entry->VariableName[0] != CHAR_NULL)
+    {
+        Entry->VariableName[0] = CHAR_NULL;
+        g_ReadCache->NegativeInvalidations++;
+    }
+}
+
+/**
+ * @brief Invalidates all entries in the read cache and the negative cache.
+ */
+static
+VOID
+FlushReadCache (
+    VOID
+    )
+{
+    UINTN interruptState;
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+    for (UINTN i = 0; i < READ_CACHE_ENTRY_COUNT; i++)
+    {
+        if (g_ReadCache->Entries[i].VariableId != VARIABLE_ID_UNKNOWN)
+        {
+            RemoveReadCacheEntry(&g_ReadCache->Entries[i]);
+            g_ReadCache->Invalidations++;
+        }
+    }
+    for (UINTN i = 0; i < NEGATIVE_CACHE_ENTRY_COUNT; i++)
+    {
+        RemoveNotFoundEntry(&g_ReadCache->NotFound[i]);
+    }
+    g_ReadCache->Generation++;
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+}
+
+/**
+ * @brief Adds the data read from the original service into the read cache.
+ *
+ * @details The data is discarded if the cache was modified or SetVariable was
+ *      in progress since the read started, as the data may be stale then.
+ */
+static
+VOID
+InsertReadCacheEntry (
+    IN UINT32 VariableId,
+    IN UINT32 Attributes,
+    IN CONST VOID* Data,
+    IN UINTN DataSize,
+    IN UINT64 Generation
+    )
+{
+    UINTN interruptState;
+    READ_CACHE_ENTRY* entry;
+    UINT8 entryIndex;
+
+    ASSERT(DataSize <= READ_CACHE_MAX_DATA_SIZE);
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+
+    if ((Generation != g_ReadCache->Generation) ||
+        (g_ReadCache->PendingSetCount != 0) ||
+        ((g_MonitorFlags & MONITOR_FLAG_READ_CACHE) == 0))
+    {
+        goto Exit;
+    }
+
+    //
+    // Reuse the entry of the variable if another processor has cached it
+    // meanwhile. Otherwise, use the free entry or evict the least recently
+    // used one.
+    //
+    entryIndex = g_ReadCache->EntryIndexes[VariableId - 1];
+    if (entryIndex == 0)
+    {
+        entry = &g_ReadCache->Entries[0];
+        for (UINTN i = 0; i < READ_CACHE_ENTRY_COUNT; i++)
+        {
+            if (g_ReadCache->Entries[i].VariableId == VARIABLE_ID_UNKNOWN)
+            {
+                entry = &g_ReadCache->Entries[i];
+                break;
+            }
+            if (g_ReadCache->Entries[i].LastUsed < entry->LastUsed)
+            {
+                entry = &g_ReadCache->Entries[i];
+            }
+        }
+
+        if (entry->VariableId != VARIABLE_ID_UNKNOWN)
+        {
+            RemoveReadCacheEntry(entry);
+            g_ReadCache->Evictions++;
+        }
+
+        entryIndex = (UINT8)(entry - g_ReadCache->Entries) + 1;
+        g_ReadCache->EntryIndexes[VariableId - 1] = entryIndex;
+    }
+
+    entry = &g_ReadCache->Entries[entryIndex - 1];
+    entry->VariableId = VariableId;
+    entry->Attributes = Attributes;
+    entry->LastUsed = ++g_ReadCache->Clock;
+    entry->DataSize = DataSize;
+    CopyMem(entry->Data, Data, DataSize);
+
+Exit:
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+}
+
+/**
+ * @brief Records that the original service did not find the variable into the
+ *      negative cache.
+ *
+ * @details The result is discarded in the same conditions as the read cache.
+ *      The caller must ensure that the name is not truncated in the variable
+ *      name table.
+ */
+static
+VOID
+InsertNotFoundEntry (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINT32 Hash,
+    IN UINT64 Generation
+    )
+{
+    UINTN interruptState;
+    NEGATIVE_CACHE_ENTRY* entry;
+
+    ASSERT(IsVariableNameTruncated(VariableName) == FALSE);
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+
+    if ((Generation == g_ReadCache->Generation) &&
+        (g_ReadCache->PendingSetCount == 0) &&
+        ((g_MonitorFlags & MONITOR_FLAG_NEGATIVE_CACHE) != 0) &&
+        (IsNotFoundCached(VariableName, VendorGuid, Hash) == FALSE))
+    {
+        entry = &g_ReadCache->NotFound[Hash & (NEGATIVE_CACHE_ENTRY_COUNT - 1)];
+        entry->Hash = Hash;
+        CopyGuid(&entry->VendorGuid, VendorGuid);
+        StrCpyS(entry->VariableName, ARRAY_SIZE(entry->VariableName), VariableName);
+        g_ReadCache->NegativeInsertions++;
+    }
+
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+}
+
+/**
+ * @brief Calls the original GetVariable service through the read cache and
+ *      the negative cache.
+ *
+ * @details The parameters are the same as those of GetVariable. Calls the
+ *      cache cannot answer in the same way as the original service are passed
+ *      down without being cached.
+ */
+static
+EFI_STATUS
+GetVariableThroughReadCache (
+    IN CHAR16* VariableName,
+    IN EFI_GUID* VendorGuid,
+    OUT UINT32* Attributes OPTIONAL,
+    IN OUT UINTN* DataSize,
+    OUT VOID* Data OPTIONAL
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINT32 hash;
+    UINT32 variableId;
+    UINT64 generation;
+    UINT8 entryIndex;
+    READ_CACHE_ENTRY* entry;
+    UINT32 attributes;
+    UINT32* attributesToReturn;
+
+    if (((g_MonitorFlags & (MONITOR_FLAG_READ_CACHE | MONITOR_FLAG_NEGATIVE_CACHE)) == 0) ||
+        (VariableName == NULL) ||
+        (DataSize == NULL) ||
+        (IsVariableNameTruncated(VariableName) != FALSE))
+    {
+        return g_GetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
+    }
+
+    hash = HashVariable(VariableName, VendorGuid);
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+
+    if (IsNotFoundCached(VariableName, VendorGuid, hash) != FALSE)
+    {
+        g_ReadCache->NegativeHits++;
+        ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+        return EFI_NOT_FOUND;
+    }
+
+    //
+    // The variable cannot be in the read cache unless it has the ID. Only look
+    // up the ID here, so that missing variables do not take up the variable
+    // name table.
+    //
+    variableId = LookUpVariableId(VariableName, VendorGuid, hash);
+    entryIndex = (variableId != VARIABLE_ID_UNKNOWN) ?
+                 g_ReadCache->EntryIndexes[variableId - 1] : 0;
+    if (entryIndex != 0)
+    {
+        entry = &g_ReadCache->Entries[entryIndex - 1];
+
+        //
+        // Variables without runtime access are no longer visible after
+        // ExitBootServices.
+        //
+        if ((EfiAtRuntime() != FALSE) &&
+            ((entry->Attributes & EFI_VARIABLE_RUNTIME_ACCESS) == 0))
+        {
+            RemoveReadCacheEntry(entry);
+            g_ReadCache->Invalidations++;
+        }
+        else if ((Data != NULL) || (*DataSize < entry->DataSize))
+        {
+            if (*DataSize < entry->DataSize)
+            {
+                status = EFI_BUFFER_TOO_SMALL;
+            }
+            else
+            {
+                CopyMem(Data, entry->Data, entry->DataSize);
+                status = EFI_SUCCESS;
+            }
+            *DataSize = entry->DataSize;
+            if (Attributes != NULL)
+            {
+                *Attributes = entry->Attributes;
+            }
+
+            entry->LastUsed = ++g_ReadCache->Clock;
+            g_ReadCache->Hits++;
+            ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+            return status;
+        }
+    }
+
+    g_ReadCache->Misses++;
+    generation = g_ReadCache->Generation;
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+
+    //
+    // Read the variable from the original service, and cache the result. The
+    // attributes are needed to cache the data even if the caller does not need
+    // them.
+    //
+    attributesToReturn = (Attributes != NULL) ? Attributes : &attributes;
+    status = g_GetVariable(VariableName, VendorGuid, attributesToReturn, DataSize, Data);
+    if ((status == EFI_SUCCESS) && (*DataSize <= READ_CACHE_MAX_DATA_SIZE))
+    {
+        if (variableId == VARIABLE_ID_UNKNOWN)
+        {
+            RaiseToDispatchLevelForNt(&interruptState);
+            variableId = GetVariableId(VariableName, VendorGuid);
+            RestoreInterruptStateForNt(interruptState);
+        }
+        if (variableId != VARIABLE_ID_UNKNOWN)
+        {
+            InsertReadCacheEntry(variableId, *attributesToReturn, Data, *DataSize, generation);
+        }
+    }
+    else if (status == EFI_NOT_FOUND)
+    {
+        InsertNotFoundEntry(VariableName, VendorGuid, hash, generation);
+    }
+    return status;
+}
+
+/**
+ * @brief Invalidates the read cache and negative cache entries of the variable
+ *      being updated, and prevents it from being cached until the update
+ *      completes.
+ */
+static
+VOID
+BeginReadCacheUpdate (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid
+    )
+{
+    UINTN interruptState;
+    UINT32 hash;
+    UINT32 variableId;
+    UINT8 entryIndex;
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+
+    g_ReadCache->Generation++;
+    g_ReadCache->PendingSetCount++;
+
+    //
+    // The variable cannot be in the read cache unless it has the ID.
+    //
+    if (VariableName != NULL)
+    {
+        hash = HashVariable(VariableName, VendorGuid);
+        variableId = LookUpVariableId(VariableName, VendorGuid, hash);
+        if (variableId != VARIABLE_ID_UNKNOWN)
+        {
+            entryIndex = g_ReadCache->EntryIndexes[variableId - 1];
+            if (entryIndex != 0)
+            {
+                RemoveReadCacheEntry(&g_ReadCache->Entries[entryIndex - 1]);
+                g_ReadCache->Invalidations++;
+            }
+        }
+        if (IsNotFoundCached(VariableName, VendorGuid, hash) != FALSE)
+        {
+            RemoveNotFoundEntry(&g_ReadCache->NotFound[hash & (NEGATIVE_CACHE_ENTRY_COUNT - 1)]);
+        }
+    }
+
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+}
+
+/**
+ * @brief Allows variables to be cached again once no update is in progress.
+ */
+static
+VOID
+EndReadCacheUpdate (
+    VOID
+    )
+{
+    UINTN interruptState;
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+    ASSERT(g_ReadCache->PendingSetCount != 0);
+    g_ReadCache->PendingSetCount--;
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+}
+
+/**
+ * @brief Compares the two variables in the order of the name index.
+ */
+static
+INTN
+CompareVariableOrder (
+    IN UINT32 VariableId1,
+    IN UINT32 VariableId2
+    )
+{
+    CONST VARIABLE_NAME_RECORD* record1;
+    CONST VARIABLE_NAME_RECORD* record2;
+    INTN result;
+
+    record1 = &g_VariableNames->Records[VariableId1 - 1];
+    record2 = &g_VariableNames->Records[VariableId2 - 1];
+    result = CompareMem(&record1->VendorGuid, &record2->VendorGuid, sizeof(record1->VendorGuid));
+    if (result != 0)
+    {
+        return result;
+    }
+    return StrCmp(record1->VariableName, record2->VariableName);
+}
+
+/**
+ * @brief Returns the position in the name index where the variable is or would
+ *      be inserted.
+ *
+ * @details The caller must hold the lock of the name index.
+ */
+static
+UINT32
+FindNameIndexPosition (
+    IN UINT32 VariableId
+    )
+{
+    UINT32 low;
+    UINT32 high;
+    UINT32 middle;
+
+    low = 0;
+    high = g_NameIndex.Count;
+    while (low < high)
+    {
+        middle = (low + high) / 2;
+        if (CompareVariableOrder(g_NameIndex.VariableIds[middle], VariableId) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Inserts the variable into the name index at the sorted position.
+ *
+ * @details The caller must hold the lock of the name index.
+ */
+static
+VOID
+InsertNameIndexEntry (
+    IN UINT32 VariableId
+    )
+{
+    UINT32 low;
+
+    if (g_NameIndex.Positions[VariableId - 1] != 0)
+    {
+        return;
+    }
+
+    low = FindNameIndexPosition(VariableId);
+    for (UINT32 i = g_NameIndex.Count; i > low; i--)
+    {
+        g_NameIndex.VariableIds[i] = g_NameIndex.VariableIds[i - 1];
+        g_NameIndex.Positions[g_NameIndex.VariableIds[i] - 1] = (UINT16)(i + 1);
+    }
+    g_NameIndex.VariableIds[low] = VariableId;
+    g_NameIndex.Positions[VariableId - 1] = (UINT16)(low + 1);
+    g_NameIndex.Count++;
+}
+
+/**
+ * @brief Removes the variable from the name index.
+ *
+ * @details The caller must hold the lock of the name index.
+ */
+static
+VOID
+RemoveNameIndexEntry (
+    IN UINT32 VariableId
+    )
+{
+    UINT32 position;
+
+    position = g_NameIndex.Positions[VariableId - 1];
+    if (position == 0)
+    {
+        return;
+    }
+
+    g_NameIndex.Positions[VariableId - 1] = 0;
+    for (UINT32 i = position - 1; (i + 1) < g_NameIndex.Count; i++)
+    {
+        g_NameIndex.VariableIds[i] = g_NameIndex.VariableIds[i + 1];
+        g_NameIndex.Positions[g_NameIndex.VariableIds[i] - 1] = (UINT16)(i + 1);
+    }
+    g_NameIndex.Count--;
+}
+
+/**
+ * @brief Checks whether the name index can answer GetNextVariableName.
+ *
+ * @details Variables without runtime access disappear at ExitBootServices, so
+ *      the index built before that cannot be used after that. The caller must
+ *      hold the lock of the name index.
+ */
+static
+BOOLEAN
+IsNameIndexUsable (
+    VOID
+    )
+{
+    return ((g_NameIndex.Valid != FALSE) &&
+            ((g_NameIndex.BuiltAtRuntime != FALSE) || (EfiAtRuntime() == FALSE)));
+}
+
+/**
+ * @brief Discards the name index, so that it is built again on the next
+ *      enumeration.
+ */
+static
+VOID
+ResetNameIndex (
+    VOID
+    )
+{
+    UINTN interruptState;
+
+    AcquireSpinLockForNt(&g_NameIndex.Lock, &interruptState);
+    g_NameIndex.Valid = FALSE;
+    g_NameIndex.Failed = FALSE;
+    g_NameIndex.Generation++;
+    ZeroMem(g_NameIndex.ReturnedByIndex, sizeof(g_NameIndex.ReturnedByIndex));
+    ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+}
+
+/**
+ * @brief Builds the name index by enumerating all variables with the original
+ *      service, unless it is already usable.
+ *
+ * @details The index is discarded if SetVariable is called during the build.
+ *      The build is not attempted again once it fails, for example, because of
+ *      a name too long for the variable name table.
+ *
+ * @return TRUE if the name index is usable on return.
+ */
+static
+BOOLEAN
+BuildNameIndex (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINT32 generation;
+    BOOLEAN builtAtRuntime;
+    BOOLEAN built;
+    BOOLEAN usable;
+    UINTN nameSize;
+    UINT32 variableId;
+    CHAR16 name[ARRAY_SIZE(g_VariableNames->Records[0].VariableName)];
+    EFI_GUID vendorGuid;
+
+    AcquireSpinLockForNt(&g_NameIndex.Lock, &interruptState);
+    if ((IsNameIndexUsable() != FALSE) ||
+        (g_NameIndex.Building != FALSE) ||
+        (g_NameIndex.Failed != FALSE) ||
+        (g_NameIndex.PendingSetCount != 0))
+    {
+        usable = IsNameIndexUsable();
+        ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+        return usable;
+    }
+
+    g_NameIndex.Valid = FALSE;
+    g_NameIndex.Building = TRUE;
+    g_NameIndex.Count = 0;
+    ZeroMem(g_NameIndex.Positions, sizeof(g_NameIndex.Positions));
+    generation = g_NameIndex.Generation;
+    builtAtRuntime = EfiAtRuntime();
+    ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+
+    built = FALSE;
+    name[0] = CHAR_NULL;
+    ZeroMem(&vendorGuid, sizeof(vendorGuid));
+    for (;;)
+    {
+        nameSize = sizeof(name);
+        status = g_GetNextVariableName(&nameSize, name, &vendorGuid);
+        if (status == EFI_NOT_FOUND)
+        {
+            built = TRUE;
+            break;
+        }
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "Name index cannot be built : %r\n", status));
+            break;
+        }
+
+        RaiseToDispatchLevelForNt(&interruptState);
+        variableId = GetVariableId(name, &vendorGuid);
+        if (variableId != VARIABLE_ID_UNKNOWN)
+        {
+            AcquireSpinLock(&g_NameIndex.Lock);
+            InsertNameIndexEntry(variableId);
+            ReleaseSpinLock(&g_NameIndex.Lock);
+        }
+        RestoreInterruptStateForNt(interruptState);
+
+        if (variableId == VARIABLE_ID_UNKNOWN)
+        {
+            DEBUG((DEBUG_ERROR, "Name index cannot be built as the name table is full\n"));
+            break;
+        }
+    }
+
+    AcquireSpinLockForNt(&g_NameIndex.Lock, &interruptState);
+    g_NameIndex.Building = FALSE;
+    if (built == FALSE)
+    {
+        g_NameIndex.Failed = TRUE;
+    }
+    else if (generation == g_NameIndex.Generation)
+    {
+        g_NameIndex.Valid = TRUE;
+        g_NameIndex.BuiltAtRuntime = builtAtRuntime;
+        g_NameIndex.Builds++;
+    }
+    usable = IsNameIndexUsable();
+    ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+    return usable;
+}
+
+/**
+ * @brief Calls the original GetNextVariableName service through the name
+ *      index.
+ *
+ * @details The parameters are the same as those of GetNextVariableName. Calls
+ *      the index cannot answer in the same way as the original service are
+ *      passed down. The index is in a different order from the original
+ *      service, so an enumeration started with one of them is continued with
+ *      the same one.
+ */
+static
+EFI_STATUS
+GetNextVariableNameThroughIndex (
+    IN OUT UINTN* VariableNameSize,
+    IN OUT CHAR16* VariableName,
+    IN OUT EFI_GUID* VendorGuid
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINTN nameLength;
+    UINT32 variableId;
+    UINT32 next;
+    UINTN nameSize;
+    CONST VARIABLE_NAME_RECORD* record;
+
+    if (((g_MonitorFlags & MONITOR_FLAG_NAME_INDEX) == 0) ||
+        (VariableNameSize == NULL) ||
+        (VariableName == NULL) ||
+        (VendorGuid == NULL))
+    {
+        goto CallOriginal;
+    }
+
+    //
+    // The name must be terminated within the buffer, and must not be truncated
+    // in the variable name table.
+    //
+    nameLength = StrnLenS(VariableName, *VariableNameSize / sizeof(CHAR16));
+    if ((nameLength == (*VariableNameSize / sizeof(CHAR16))) ||
+        (nameLength >= (ARRAY_SIZE(g_VariableNames->Records[0].VariableName) - 1)))
+    {
+        goto CallOriginal;
+    }
+
+    //
+    // Continue with the index only if the enumeration was started with it.
+    //
+    variableId = VARIABLE_ID_UNKNOWN;
+    if (nameLength != 0)
+    {
+        variableId = LookUpVariableId(VariableName,
+                                      VendorGuid,
+                                      HashVariable(VariableName, VendorGuid));
+        if ((variableId == VARIABLE_ID_UNKNOWN) ||
+            (g_NameIndex.ReturnedByIndex[variableId - 1] == FALSE))
+        {
+            goto CallOriginal;
+        }
+    }
+
+    //
+    // Build the index when the enumeration starts. The order of the index
+    // depends only on the names, so the enumeration can also be continued with
+    // the index built again after it is discarded.
+    //
+    if (BuildNameIndex() == FALSE)
+    {
+        goto CallOriginal;
+    }
+
+    AcquireSpinLockForNt(&g_NameIndex.Lock, &interruptState);
+
+    if (IsNameIndexUsable() == FALSE)
+    {
+        ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+        goto CallOriginal;
+    }
+
+    //
+    // Positions hold the position plus one, which is the position of the next
+    // variable. If the variable has been deleted, the next variable is the one
+    // at the position it would be inserted.
+    //
+    if (variableId == VARIABLE_ID_UNKNOWN)
+    {
+        next = 0;
+    }
+    else if (g_NameIndex.Positions[variableId - 1] != 0)
+    {
+        next = g_NameIndex.Positions[variableId - 1];
+    }
+    else
+    {
+        next = FindNameIndexPosition(variableId);
+    }
+
+    if (next >= g_NameIndex.Count)
+    {
+        status = EFI_NOT_FOUND;
+    }
+    else
+    {
+        record = &g_VariableNames->Records[g_NameIndex.VariableIds[next] - 1];
+        nameSize = StrSize(record->VariableName);
+        if (*VariableNameSize < nameSize)
+        {
+            status = EFI_BUFFER_TOO_SMALL;
+        }
+        else
+        {
+            CopyMem(VariableName, record->VariableName, nameSize);
+            CopyGuid(VendorGuid, &record->VendorGuid);
+            g_NameIndex.ReturnedByIndex[g_NameIndex.VariableIds[next] - 1] = TRUE;
+            status = EFI_SUCCESS;
+        }
+        *VariableNameSize = nameSize;
+    }
+    g_NameIndex.Hits++;
+
+    ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+    return status;
+
+CallOriginal:
+    status = g_GetNextVariableName(VariableNameSize, VariableName, VendorGuid);
+    if ((status == EFI_SUCCESS) &&
+        ((g_MonitorFlags & MONITOR_FLAG_NAME_INDEX) != 0) &&
+        (IsVariableNameTruncated(VariableName) == FALSE))
+    {
+        variableId = LookUpVariableId(VariableName,
+                                      VendorGuid,
+                                      HashVariable(VariableName, VendorGuid));
+        if (variableId != VARIABLE_ID_UNKNOWN)
+        {
+            g_NameIndex.ReturnedByIndex[variableId - 1] = FALSE;
+        }
+    }
+    return status;
+}
+
+/**
+ * @brief Prevents the name index from being built until the SetVariable call
+ *      completes.
+ *
+ * @return TRUE if EndNameIndexUpdate must be called after the call.
+ */
+static
+BOOLEAN
+BeginNameIndexUpdate (
+    VOID
+    )
+{
+    UINTN interruptState;
+
+    if ((g_MonitorFlags & MONITOR_FLAG_NAME_INDEX) == 0)
+    {
+        return FALSE;
+    }
+
+    AcquireSpinLockForNt(&g_NameIndex.Lock, &interruptState);
+    g_NameIndex.Generation++;
+    g_NameIndex.PendingSetCount++;
+    ReleaseSpinLockForNt(&g_NameIndex.Lock, interruptState);
+    return TRUE;
+}
+
+/**
+ * @brief Updates the name index with the result of the SetVariable call.
+ *
+ * @details Whether the call created or deleted the variable is determined by
+ *      querying the original GetVariable service, as authenticated writes can
+ *      delete the variable with non-zero size data. The index is discarded if
+ *      the result cannot be determined or SetVariable calls overlapped.
+ */
+static
+VOID
+EndNameIndexUpdate (
+    IN CHAR16* VariableName,
+    IN EFI_GUID* VendorGuid,
+    IN EFI_STATUS Status
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINTN dataSize;
+    UINT32 variableId;
+    BOOLEAN exists;
+    BOOLEAN known;
+
+    exists = FALSE;
+    known = FALSE;
+    if ((Status == EFI_SUCCESS) &&
+        (VariableName != NULL) &&
+        (g_NameIndex.Valid != FALSE))
+    {
+        dataSize = 0;
+        status = g_GetVariable(VariableName, VendorGuid, NULL, &dataSize, NULL);
+        exists = (status == EFI_BUFFER_TOO_SMALL);
+        known = ((exists != FALSE) || (status == EFI_NOT_FOUND)) &&
+                (StrnLenS(VariableName, ARRAY_SIZE(g_VariableNames->Records[0].VariableName)) <
+                 (ARRAY_SIZE(g_VariableNames->Records[0].VariableName) - 1));
+    }
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    variableId = VARIABLE_ID_UNKNOWN;
+    if (known != FALSE)
+    {
+        variableId = (exists != FALSE) ?
+            GetVariableId(VariableName, VendorGuid) :
+            LookUpVariableId(VariableName, VendorGuid, HashVariable(VariableName, VendorGuid));
+    }
+
+    AcquireSpinLock(&g_NameIndex.Lock);
+    if ((g_NameIndex.Valid != FALSE) && (Status == EFI_SUCCESS))
+    {
+        if ((known == FALSE) ||
+            (g_NameIndex.PendingSetCount != 1) ||
+            ((exists != FALSE) && (variableId == VARIABLE_ID_UNKNOWN)))
+        {
+            g_NameIndex.Valid = FALSE;
+        }
+        else if (exists != FALSE)
+        {
+            InsertNameIndexEntry(variableId);
+        }
+        else if (variableId != VARIABLE_ID_UNKNOWN)
+        {
+            RemoveNameIndexEntry(variableId);
+        }
+    }
+
+    ASSERT(g_NameIndex.PendingSetCount != 0);
+    g_NameIndex.PendingSetCount--;
+    g_NameIndex.Generation++;
+    ReleaseSpinLock(&g_NameIndex.Lock);
+
+    RestoreInterruptStateForNt(interruptState);
+}
+
+/**
+ * @brief Marks the variable dirty if it is in the watch list.
+ */
+static
+VOID
+MarkWatchedVariableDirty (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid
+    )
+{
+    UINT32 variableId;
+    UINT8 watchIndex;
+    UINT64 bitmap;
+    UINT64 bit;
+
+    if ((g_WatchList.Count == 0) || (VariableName == NULL) || (VendorGuid == NULL))
+    {
+        return;
+    }
+
+    //
+    // Watched variables are registered when the watch list is set. Hence, a
+    // variable not registered is not watched.
+    //
+    variableId = LookUpVariableId(VariableName,
+                                  VendorGuid,
+                                  HashVariable(VariableName, VendorGuid));
+    if (variableId == VARIABLE_ID_UNKNOWN)
+    {
+        return;
+    }
+
+    watchIndex = g_WatchList.WatchIndexes[variableId - 1];
+    if (watchIndex == 0)
+    {
+        return;
+    }
+
+    //
+    // Set the bit before incrementing the generation, so that the caller that
+    // observes the new generation also observes the bit.
+    //
+    bit = LShiftU64(1, watchIndex - 1);
+    do
+    {
+        bitmap = g_WatchList.DirtyBitmap;
+    } while (InterlockedCompareExchange64(&g_WatchList.DirtyBitmap,
+                                          bitmap,
+                                          bitmap | bit) != bitmap);
+    InterlockedIncrement(&g_WatchList.Generation);
+}
+
+/**
+ * @brief Queues the Post-call for the deferred callback.
+ *
+ * @details The caller must have raised the interrupt level.
+ */
+static
+VOID
+QueueDeferredCallbackEvent (
+    IN OUT DEFERRED_CALLBACK_QUEUE* Queue,
+    IN CONST VARIABLE_CALLBACK_PARAMETERS* Parameters
+    )
+{
+    DEFERRED_CALLBACK_EVENT* event;
+    CONST CHAR16* variableName;
+    CONST EFI_GUID* vendorGuid;
+    UINT32 attributes;
+    UINTN dataSize;
+    CONST VOID* data;
+    EFI_STATUS status;
+
+    ASSERT(Parameters->OperationType == OperationPost);
+
+    //
+    // The data and attributes of GetVariable are valid only when it succeeded.
+    //
+    if (Parameters->CallbackType == VariableCallbackGet)
+    {
+        variableName = *Parameters->Parameters.Get.VariableName;
+        vendorGuid = *Parameters->Parameters.Get.VendorGuid;
+        status = Parameters->Parameters.Get.Status;
+        attributes = 0;
+        dataSize = 0;
+        data = NULL;
+        if (Parameters->Parameters.Get.Succeeded != FALSE)
+        {
+            if (*Parameters->Parameters.Get.Attributes != NULL)
+            {
+                attributes = **Parameters->Parameters.Get.Attributes;
+            }
+            dataSize = **Parameters->Parameters.Get.DataSize;
+            data = *Parameters->Parameters.Get.Data;
+        }
+    }
+    else
+    {
+        variableName = *Parameters->Parameters.Set.VariableName;
+        vendorGuid = *Parameters->Parameters.Set.VendorGuid;
+        status = Parameters->Parameters.Set.Status;
+        attributes = *Parameters->Parameters.Set.Attributes;
+        dataSize = *Parameters->Parameters.Set.DataSize;
+        data = *Parameters->Parameters.Set.Data;
+    }
+
+    AcquireSpinLock(&Queue->Lock);
+
+    if (Queue->Count == DEFERRED_CALLBACK_QUEUE_LENGTH)
+    {
+        Queue->DroppedEvents++;
+        goto ExitLocked;
+    }
+
+    event = &Queue->Events[(Queue->Head + Queue->Count) % DEFERRED_CALLBACK_QUEUE_LENGTH];
+    Queue->Count++;
+
+    ZeroMem(event, OFFSET_OF(DEFERRED_CALLBACK_EVENT, Data));
+    event->Status = status;
+    event->CallbackType = (UINT8)Parameters->CallbackType;
+    event->Attributes = attributes;
+    event->DataSize = (UINT32)dataSize;
+    event->CapturedSize = (data == NULL) ? 0 : (UINT32)MIN(dataSize, sizeof(event->Data));
+    CopyGuid(&event->VendorGuid, vendorGuid);
+    StrnCpyS(event->VariableName,
+             ARRAY_SIZE(event->VariableName),
+             variableName,
+             ARRAY_SIZE(event->VariableName) - 1);
+    CopyMem(event->Data, data, event->CapturedSize);
+
+ExitLocked:
+    ReleaseSpinLock(&Queue->Lock);
+}
+
+/**
+ * @brief Checks whether any registered callback subscribes the call.
+ *
+ * @details This is read without announcing the set, as a hint to skip building
+ *      the parameters. A concurrent writer can make the result stale, which is
+ *      the same as the call being made just before or after the registration.
+ */
+static
+BOOLEAN
+IsCallSubscribed (
+    IN VARIABLE_CALLBACK_TYPE CallbackType,
+    IN OPERATION_TYPE OperationType
+    )
+{
+    UINT32 subscribedCalls;
+
+    subscribedCalls = g_CallbackSets[g_PublishedCallbackSetIndex].SubscribedCalls;
+    return ((subscribedCalls & CALLBACK_CALL_BIT(CallbackType, OperationType)) != 0);
+}
+
+/**
+ * @brief Checks whether the call matches the subscription of the callback.
+ */
+static
+BOOLEAN
+IsCallbackEntryMatched (
+    IN CONST CALLBACK_ENTRY* Entry,
+    IN CONST VARIABLE_CALLBACK_PARAMETERS* Parameters
+    )
+{
+    CONST CHAR16* variableName;
+    CONST EFI_GUID* vendorGuid;
+
+    if ((Entry->SubscribedCalls &
+         CALLBACK_CALL_BIT(Parameters->CallbackType, Parameters->OperationType)) == 0)
+    {
+        return FALSE;
+    }
+
+    if (Entry->Filters == 0)
+    {
+        return TRUE;
+    }
+
+    //
+    // Use the current name and GUID, as preceding callbacks may have changed them.
+    //
+    if (Parameters->CallbackType == VariableCallbackGet)
+    {
+        variableName = *Parameters->Parameters.Get.VariableName;
+        vendorGuid = *Parameters->Parameters.Get.VendorGuid;
+    }
+    else
+    {
+        variableName = *Parameters->Parameters.Set.VariableName;
+        vendorGuid = *Parameters->Parameters.Set.VendorGuid;
+    }
+
+    if (((Entry->Filters & SUBSCRIPTION_FILTER_VENDOR_GUID) != 0) &&
+        (CompareGuid(vendorGuid, &Entry->VendorGuid) == FALSE))
+    {
+        return FALSE;
+    }
+
+    if (((Entry->Filters & SUBSCRIPTION_FILTER_NAME_PREFIX) != 0) &&
+        (StrnCmp(variableName, Entry->NamePrefix, Entry->NamePrefixLength) != 0))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Invokes all callbacks in the set that subscribe the call.
+ */
+static
+BOOLEAN
+RunCallbacks (
+    IN CONST CALLBACK_SET* CallbackSet,
+    IN OUT VARIABLE_CALLBACK_PARAMETERS* Parameters
+    )
+{
+    BOOLEAN blocked;
+
+    blocked = FALSE;
+    for (UINTN i = 0; i < CallbackSet->Count; i++)
+    {
+        if (IsCallbackEntryMatched(&CallbackSet->Entries[i], Parameters) == FALSE)
+        {
+            continue;
+        }
+
+        //
+        // Queue the call for the deferred callback instead of invoking it.
+        //
+        if ((CallbackSet->Entries[i].Flags & SUBSCRIPTION_FLAG_DEFERRED) != 0)
+        {
+            QueueDeferredCallbackEvent(CallbackSet->Entries[i].DeferredQueue, Parameters);
+            continue;
+        }
+
+        //
+        // Invoke a callback. The blocked status cannot be override if any of
+        // callbacks returned TRUE.
+        //
+        blocked |= CallbackSet->Entries[i].Callback(Parameters);
+    }
+    return blocked;
+}
+
+/**
+ * @brief Invokes all registered callbacks.
+ *
+ * @details The published callback set is walked without a lock. The current
+ *      processor announces the set it reads, so that writers do not reuse the
+ *      set until the processor finishes. Hence, callbacks on different
+ *      processors run in parallel.
+ */
+static
+EFI_STATUS
+InvokeCallbacks (
+    IN OUT VARIABLE_CALLBACK_PARAMETERS* Parameters
+    )
+{
+    UINTN interruptState;
+    PROCESSOR_CONTEXT* processor;
+    UINT32 index;
+    UINT32 previousIndex;
+    BOOLEAN blocked;
+
+    RaiseToDispatchLevelForNt(&interruptState);
+
+    processor = GetCurrentProcessorContext();
+    if (processor == NULL)
+    {
+        //
+        // The processor cannot announce the set to read without its context.
+        // Exclude writers with the lock instead.
+        //
+        AcquireSpinLock(&g_VariableCallbacksLock);
+        blocked = RunCallbacks(&g_CallbackSets[g_PublishedCallbackSetIndex], Parameters);
+        ReleaseSpinLock(&g_VariableCallbacksLock);
+        goto Exit;
+    }
+
+    //
+    // Announce the set to read, then make sure it is still published. The
+    // interlocked operation orders the announcement against the re-read. The
+    // previous value is restored in case callbacks call into this function.
+    //
+    previousIndex = processor->ReadingCallbackSet;
+    do
+    {
+        index = g_PublishedCallbackSetIndex;
+        InterlockedCompareExchange32(&processor->ReadingCallbackSet,
+                                     processor->ReadingCallbackSet,
+                                     index + 1);
+    } while (index != g_PublishedCallbackSetIndex);
+
+    blocked = RunCallbacks(&g_CallbackSets[index], Parameters);
+
+    MemoryFence();
+    processor->ReadingCallbackSet = previousIndex;
+
+Exit:
+    RestoreInterruptStateForNt(interruptState);
+
+    //
+    // Return EFI_ACCESS_DENIED if any of callbacks returned TRUE.
+    //
+    return (blocked == FALSE) ? EFI_SUCCESS : EFI_ACCESS_DENIED;
+}
+
+/**
+ * @brief Invokes all registered Get callbacks.
+ */
+static
+EFI_STATUS
+InvokeGetCallbacks (
+    IN OPERATION_TYPE OperationType,
+    IN OUT CHAR16** VariableName,
+    IN OUT EFI_GUID** VendorGuid,
+    IN OUT UINT32** Attributes OPTIONAL,
+    IN OUT UINTN** DataSize,
+    IN OUT VOID** Data OPTIONAL,
+    IN CONST EFI_STATUS* ResultStatus OPTIONAL
+    )
+{
+    BOOLEAN succeeded;
+    EFI_STATUS status;
+    VARIABLE_CALLBACK_PARAMETERS parameters;
+
+    if (IsCallSubscribed(VariableCallbackGet, OperationType) == FALSE)
+    {
+        return EFI_SUCCESS;
+    }
+
+    //
+    // Pass the resulted status as is if it is given. Callbacks convert it to a
+    // human readable string with GetStatusMessage only when they need it.
+    //
+    if (ResultStatus != NULL)
+    {
+        status = *ResultStatus;
+        succeeded = (EFI_ERROR(status) == FALSE);
+    }
+    else
+    {
+        status = EFI_SUCCESS;
+        succeeded = FALSE;
+    }
+
+    parameters.CallbackType = VariableCallbackGet;
+    parameters.OperationType = OperationType;
+    parameters.Parameters.Get.VariableName = VariableName;
+    parameters.Parameters.Get.VendorGuid = VendorGuid;
+    parameters.Parameters.Get.Attributes = Attributes;
+    parameters.Parameters.Get.DataSize = DataSize;
+    parameters.Parameters.Get.Data = Data;
+    parameters.Parameters.Get.Succeeded = succeeded;
+    parameters.Parameters.Get.Status = status;
+
+    return InvokeCallbacks(&parameters);
+}
+
+/**
+ * @brief Invokes all registered Set callbacks.
+ */
+static
+EFI_STATUS
+ProcessSetCallbacks (
+    IN OPERATION_TYPE OperationType,
+    IN OUT CHAR16** VariableName,
+    IN OUT EFI_GUID** VendorGuid,
+    IN OUT UINT32* Attributes,
+    IN OUT UINTN* DataSize,
+    IN OUT VOID** Data,
+    IN CONST EFI_STATUS* ResultStatus OPTIONAL
+    )
+{
+    BOOLEAN succeeded;
+    EFI_STATUS status;
+    VARIABLE_CALLBACK_PARAMETERS parameters;
+
+    if (IsCallSubscribed(VariableCallbackSet, OperationType) == FALSE)
+    {
+        return EFI_SUCCESS;
+    }
+
+    //
+    // Pass the resulted status as is if it is given. Callbacks convert it to a
+    // human readable string with GetStatusMessage only when they need it.
+    //
+    if (ResultStatus != NULL)
+    {
+        status = *ResultStatus;
+        succeeded = (EFI_ERROR(status) == FALSE);
+    }
+    else
+    {
+        status = EFI_SUCCESS;
+        succeeded = FALSE;
+    }
+
+    parameters.CallbackType = VariableCallbackSet;
+    parameters.OperationType = OperationType;
+    parameters.Parameters.Set.VariableName = VariableName;
+    parameters.Parameters.Set.VendorGuid = VendorGuid;
+    parameters.Parameters.Set.Attributes = Attributes;
+    parameters.Parameters.Set.DataSize = DataSize;
+    parameters.Parameters.Set.Data = Data;
+    parameters.Parameters.Set.Succeeded = succeeded;
+    parameters.Parameters.Set.Status = status;
+
+    return InvokeCallbacks(&parameters);
+}
+
+/**
+ * @brief Invokes the Pre- Get callbacks for the variable a backdoor command
+ *      reads on behalf of the caller.
+ *
+ * @details Callbacks can deny the read in the same way as for the GetVariable
+ *      hook. Changes they make to the parameters are not applied, as the
+ *      command returns the variable in its own buffer.
+ *
+ * @return EFI_ACCESS_DENIED if any callback denied the read.
+ */
+static
+EFI_STATUS
+InvokeGetCallbacksForCommand (
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid,
+    IN UINTN DataSize,
+    IN VOID* Data
+    )
+{
+    CHAR16* variableName;
+    EFI_GUID* vendorGuid;
+    UINT32 attributes;
+    UINT32* attributesPointer;
+    UINTN dataSize;
+    UINTN* dataSizePointer;
+    VOID* data;
+
+    variableName = (CHAR16*)VariableName;
+    vendorGuid = (EFI_GUID*)VendorGuid;
+    attributes = 0;
+    attributesPointer = &attributes;
+    dataSize = DataSize;
+    dataSizePointer = &dataSize;
+    data = Data;
+    return InvokeGetCallbacks(OperationPre,
+                              &variableName,
+                              &vendorGuid,
+                              &attributesPointer,
+                              &dataSizePointer,
+                              &data,
+                              NULL);
+}
+
+/**
+ * @brief Returns the oldest log record in the ring, discarding padding.
+ */
+static
+CONST LOG_RECORD_HEADER*
+PeekLogRecord (
+    IN OUT LOG_RING* Ring
+    )
+{
+    CONST LOG_RECORD_HEADER* record;
+
+    while (Ring->Tail != Ring->Head)
+    {
+        record = (CONST LOG_RECORD_HEADER*)&Ring->Buffer[Ring->Tail % Ring->Size];
+        if (record->RecordType == LogRecordEntry)
+        {
+            return record;
+        }
+        Ring->Tail += record->RecordSize;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Checks whether all inactive log rings are drained.
+ */
+static
+BOOLEAN
+AreInactiveLogRingsEmpty (
+    IN UINTN InactiveRingIndex
+    )
+{
+    CONST LOG_RING* ring;
+
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        ring = &g_Processors[i].LogRings[InactiveRingIndex];
+        if (ring->Tail != ring->Head)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Swaps the active and inactive log rings of all processors at once.
+ *
+ * @details The ring selector is a bit of the sequence number, so every entry
+ *      in the rings swapped out has a lower sequence number than any entry
+ *      added after the swap. This function waits until processors finish
+ *      adding entries to the rings swapped out. Producers run at raised
+ *      interrupt level without taking locks, so the wait is short. The caller
+ *      must hold the drain lock.
+ *
+ * @return The index of the rings swapped out.
+ */
+static
+UINTN
+SwapLogRings (
+    VOID
+    )
+{
+    UINT64 current;
+
+    do
+    {
+        current = g_LogSequenceNumber;
+    } while (InterlockedCompareExchange64(&g_LogSequenceNumber,
+                                          current,
+                                          current ^ ACTIVE_LOG_RING_BIT) != current);
+
+    g_LogDrainLimit = (current & ~ACTIVE_LOG_RING_BIT);
+
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        while (g_Processors[i].PendingSequenceNumber < g_LogDrainLimit)
+        {
+            CpuPause();
+        }
+    }
+    MemoryFence();
+
+    return ((current & ACTIVE_LOG_RING_BIT) != 0) ? 1 : 0;
+}
+
+/**
+ * @brief Moves log entries from the log rings of all processors to the buffer.
+ *
+ * @details Entries are moved from the inactive rings in order of the sequence
+ *      numbers until no more entry fits in the buffer. The rings are swapped
+ *      when the inactive rings are empty, at most once per call, so the copy
+ *      never blocks producers. Entries with sequence numbers lower than the
+ *      cursor are discarded. The cursor is updated to the sequence number
+ *      following the last entry moved, and the gaps of the sequence numbers
+ *      are reported as lost entries, as only discarded and overwritten entries
+ *      leave them. The caller must hold the drain lock.
+ *
+ * @return The size of the next entry if it did not fit in the buffer, or 0
+ *      if all published entries were moved.
+ */
+static
+UINTN
+DrainLogEntries (
+    OUT VOID* Buffer OPTIONAL,
+    IN UINTN BufferSize,
+    IN OUT UINT64* Cursor,
+    OUT UINTN* DrainedSize,
+    OUT UINT32* EntryCount,
+    OUT UINT64* LostEntries
+    )
+{
+    UINTN inactiveRingIndex;
+    BOOLEAN swapped;
+    UINTN entrySize;
+    LOG_RING* ring;
+    LOG_RING* oldestRing;
+    CONST LOG_RECORD_HEADER* record;
+    CONST LOG_RECORD_HEADER* oldestRecord;
+
+    *DrainedSize = 0;
+    *EntryCount = 0;
+    *LostEntries = 0;
+
+    inactiveRingIndex = ((g_LogSequenceNumber & ACTIVE_LOG_RING_BIT) != 0) ? 0 : 1;
+    swapped = FALSE;
+
+    for (;;)
+    {
+        //
+        // Any sequence numbers not seen below the limit belong to entries that
+        // were discarded or overwritten.
+        //
+        if (AreInactiveLogRingsEmpty(inactiveRingIndex) != FALSE)
+        {
+            if (*Cursor < g_LogDrainLimit)
+            {
+                *LostEntries += g_LogDrainLimit - *Cursor;
+                *Cursor = g_LogDrainLimit;
+            }
+
+            if (swapped != FALSE)
+            {
+                break;
+            }
+            inactiveRingIndex = SwapLogRings();
+            swapped = TRUE;
+            continue;
+        }
+
+        oldestRing = NULL;
+        oldestRecord = NULL;
+        for (UINTN i = 0; i < g_ProcessorCount; i++)
+        {
+            ring = &g_Processors[i].LogRings[inactiveRingIndex];
+            record = PeekLogRecord(ring);
+            if ((record != NULL) &&
+                ((oldestRecord == NULL) ||
+                 (record->SequenceNumber < oldestRecord->SequenceNumber)))
+            {
+                oldestRing = ring;
+                oldestRecord = record;
+            }
+        }
+
+        //
+        // PeekLogRecord may have discarded trailing padding.
+        //
+        if (oldestRecord == NULL)
+        {
+            continue;
+        }
+
+        //
+        // Discard the entry if the consumer does not want it.
+        //
+        if (oldestRecord->SequenceNumber >= *Cursor)
+        {
+            entrySize = oldestRecord->RecordSize - sizeof(*oldestRecord);
+            if ((*DrainedSize + entrySize) > BufferSize)
+            {
+                return entrySize;
+            }
+
+            CopyMem((UINT8*)Buffer + *DrainedSize, oldestRecord + 1, entrySize);
+            *DrainedSize += entrySize;
+            *EntryCount += 1;
+            *LostEntries += oldestRecord->SequenceNumber - *Cursor;
+            *Cursor = oldestRecord->SequenceNumber + 1;
+        }
+
+        oldestRing->Tail += oldestRecord->RecordSize;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Moves the contents of the log buffer to the provided buffer.
+ */
+static
+EFI_STATUS
+HandleDrainBufferCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINTN logBufferSize;
+    UINTN drainedSize;
+    UINT32 entryCount;
+    UINT64 cursor;
+    UINT64 lostEntries;
+
+    //
+    // Return the log buffer size if the provided buffer size is smaller than that.
+    // The size is of all rings grown to the configured size.
+    //
+    logBufferSize = sizeof(LOG_BUFFER_HEADER) +
+                    (g_ProcessorCount *
+                     ARRAY_SIZE(g_Processors[0].LogRings) *
+                     EFI_PAGES_TO_SIZE(g_LogRingSizeInPages));
+    if (*BufferSize < logBufferSize)
+    {
+        *BufferSize = logBufferSize;
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+    if (Buffer == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    //
+    // Move the entries to the provided buffer after the header, and update the
+    // buffer size with the drained size. The buffer can hold all entries in the
+    // inactive rings and the active ones being swapped out.
+    //
+    CopyMem(Buffer, &g_LogBufferHeader, sizeof(g_LogBufferHeader));
+
+    cursor = 0;
+    AcquireSpinLockForNt(&g_LogDrainLock, &interruptState);
+    DrainLogEntries((LOG_BUFFER_HEADER*)Buffer + 1,
+                    *BufferSize - sizeof(LOG_BUFFER_HEADER),
+                    &cursor,
+                    &drainedSize,
+                    &entryCount,
+                    &lostEntries);
+    ReleaseSpinLockForNt(&g_LogDrainLock, interruptState);
+
+    *BufferSize = sizeof(LOG_BUFFER_HEADER) + drainedSize;
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Moves as many log entries as fit to the provided buffer, starting at
+ *      the cursor specified in the buffer.
+ */
+static
+EFI_STATUS
+HandleDrainBufferExCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    UINTN drainedSize;
+    UINTN nextEntrySize;
+    DRAIN_BUFFER_EX_HEADER* header;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(DRAIN_BUFFER_EX_HEADER)))
+    {
+        *BufferSize = sizeof(DRAIN_BUFFER_EX_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (DRAIN_BUFFER_EX_HEADER*)Buffer;
+
+    AcquireSpinLockForNt(&g_LogDrainLock, &interruptState);
+    nextEntrySize = DrainLogEntries(header + 1,
+                                    *BufferSize - sizeof(*header),
+                                    &header->Cursor,
+                                    &drainedSize,
+                                    &header->EntryCount,
+                                    &header->LostEntries);
+    ReleaseSpinLockForNt(&g_LogDrainLock, interruptState);
+
+    //
+    // Return the size required for the next entry if not even one entry fits.
+    //
+    if ((header->EntryCount == 0) && (nextEntrySize != 0))
+    {
+        *BufferSize = sizeof(*header) + nextEntrySize;
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header->Log = g_LogBufferHeader;
+    header->Flags = (nextEntrySize != 0) ? DRAIN_BUFFER_EX_FLAG_MORE_ENTRIES : 0;
+    header->Reserved = 0;
+    *BufferSize = sizeof(*header) + drainedSize;
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Updates the configuration of the module.
+ */
+static
+EFI_STATUS
+HandleSetConfigurationCommand (
+    IN VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    CONST MONITOR_CONFIGURATION* configuration;
+    UINT32 changedFlags;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize != sizeof(MONITOR_CONFIGURATION)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    configuration = (CONST MONITOR_CONFIGURATION*)Buffer;
+    if ((configuration->LogMode > LogModeAggregateOnly) ||
+        (configuration->CaptureMode > CaptureModeDigest) ||
+        ((configuration->Flags & ~(MONITOR_FLAG_READ_CACHE |
+                                   MONITOR_FLAG_NEGATIVE_CACHE |
+                                   MONITOR_FLAG_DETECT_REDUNDANT_WRITES |
+                                   MONITOR_FLAG_SKIP_REDUNDANT_WRITES |
+                                   MONITOR_FLAG_NAME_INDEX)) != 0))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    g_LogMode = (LOG_MODE)configuration->LogMode;
+    g_CaptureSize = configuration->CaptureSize;
+    g_CaptureMode = (CAPTURE_MODE)configuration->CaptureMode;
+
+    //
+    // Compare with the current flags once, as any number of them may change
+    // in this call. The flags are updated only after everything below is reset.
+    // Whatever is recorded meanwhile under the previous flags is discarded
+    // again when the flag is toggled next time, before it is used.
+    //
+    changedFlags = (configuration->Flags ^ g_MonitorFlags);
+
+    //
+    // Start over the caches when either is enabled or disabled, so that they
+    // never hold the results from the previous period.
+    //
+    if ((changedFlags & (MONITOR_FLAG_READ_CACHE | MONITOR_FLAG_NEGATIVE_CACHE)) != 0)
+    {
+        FlushReadCache();
+    }
+
+    //
+    // Likewise, forget the shadow digests when the detection of redundant
+    // writes is enabled or disabled, as they are not updated while disabled.
+    //
+    if ((changedFlags & (MONITOR_FLAG_DETECT_REDUNDANT_WRITES |
+                         MONITOR_FLAG_SKIP_REDUNDANT_WRITES)) != 0)
+    {
+        InvalidateShadowDigests();
+    }
+
+    //
+    // The name index is not kept in sync while disabled.
+    //
+    if ((changedFlags & MONITOR_FLAG_NAME_INDEX) != 0)
+    {
+        ResetNameIndex();
+    }
+    g_MonitorFlags = configuration->Flags;
+
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the current configuration of the module.
+ */
+static
+EFI_STATUS
+HandleGetConfigurationCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    MONITOR_CONFIGURATION* configuration;
+
+    if (*BufferSize < sizeof(MONITOR_CONFIGURATION))
+    {
+        *BufferSize = sizeof(MONITOR_CONFIGURATION);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+    if (Buffer == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    configuration = (MONITOR_CONFIGURATION*)Buffer;
+    ZeroMem(configuration, sizeof(*configuration));
+    configuration->LogMode = g_LogMode;
+    configuration->CaptureMode = g_CaptureMode;
+    configuration->CaptureSize = g_CaptureSize;
+    configuration->Flags = g_MonitorFlags;
+
+    *BufferSize = sizeof(MONITOR_CONFIGURATION);
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the statistics of the module.
+ *
+ * @details The counters are read without synchronization with producers, so
+ *      they may be slightly behind the latest values. Per-variable statistics
+ *      follow the fixed part as many as the buffer can hold.
+ *
+ *      The size returned with EFI_BUFFER_TOO_SMALL is based on the number of
+ *      the variables at that time, which may grow before the next call. The
+ *      per-variable statistics are clamped to the buffer then, and the caller
+ *      can tell it from VariableStatisticsCount being less than VariableCount.
+ */
+static
+EFI_STATUS
+HandleGetStatsCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    MONITOR_STATISTICS* statistics;
+    VARIABLE_LATENCY_STATISTICS* variableStatistics;
+    CONST LOG_RING* ring;
+    CONST LATENCY_STATISTICS* latency;
+    UINT32 variableCount;
+    UINTN capacity;
+
+    //
+    // The count is read once without the lock, so that the size returned and
+    // the number of the statistics copied are consistent within this call.
+    //
+    variableCount = g_VariableNames->Count;
+    MemoryFence();
+    if (*BufferSize < sizeof(MONITOR_STATISTICS))
+    {
+        *BufferSize = sizeof(MONITOR_STATISTICS) +
+                      (variableCount * sizeof(VARIABLE_LATENCY_STATISTICS));
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+    if (Buffer == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    statistics = (MONITOR_STATISTICS*)Buffer;
+    ZeroMem(statistics, sizeof(*statistics));
+    statistics->LogRingCount = g_ProcessorCount * ARRAY_SIZE(g_Processors[0].LogRings);
+    statistics->LogRingSize = EFI_PAGES_TO_SIZE(g_LogRingSizeInPages);
+    statistics->TscFrequency = g_LogBufferHeader.TscFrequency;
+    statistics->ReadCacheHits = g_ReadCache->Hits;
+    statistics->ReadCacheMisses = g_ReadCache->Misses;
+    statistics->ReadCacheEvictions = g_ReadCache->Evictions;
+    statistics->ReadCacheInvalidations = g_ReadCache->Invalidations;
+    statistics->NegativeCacheHits = g_ReadCache->NegativeHits;
+    statistics->NegativeCacheInsertions = g_ReadCache->NegativeInsertions;
+    statistics->NegativeCacheInvalidations = g_ReadCache->NegativeInvalidations;
+    statistics->NameIndexHits = g_NameIndex.Hits;
+    statistics->NameIndexBuilds = g_NameIndex.Builds;
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        for (UINTN j = 0; j < ARRAY_SIZE(g_Processors[i].LogRings); j++)
+        {
+            ring = &g_Processors[i].LogRings[j];
+            statistics->DroppedEntries += ring->DroppedEntries;
+            statistics->OverwrittenEntries += ring->OverwrittenEntries;
+            statistics->LogHighWaterMark = MAX(statistics->LogHighWaterMark,
+                                               ring->HighWaterMark);
+        }
+
+        latency = &g_Processors[i].Latency;
+        for (UINTN type = 0; type < ARRAY_SIZE(latency->Service); type++)
+        {
+            for (UINTN bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++)
+            {
+                statistics->ServiceLatency[type][bucket] += latency->Service[type][bucket];
+                statistics->HookLatency[type][bucket] += latency->Hook[type][bucket];
+                statistics->CallbackLatency[type][bucket] += latency->Callback[type][bucket];
+            }
+        }
+    }
+
+    //
+    // Return the per-variable statistics as many as the buffer can hold.
+    //
+    capacity = (*BufferSize - sizeof(*statistics)) / sizeof(*variableStatistics);
+    statistics->VariableCount = variableCount;
+    statistics->VariableStatisticsCount = (UINT32)MIN(capacity, variableCount);
+
+    variableStatistics = (VARIABLE_LATENCY_STATISTICS*)(statistics + 1);
+    for (UINT32 i = 0; i < statistics->VariableStatisticsCount; i++)
+    {
+        variableStatistics[i].VariableId = i + 1;
+        variableStatistics[i].Reserved = 0;
+        CopyMem(variableStatistics[i].ServiceLatency,
+                (CONST VOID*)g_VariableNames->Statistics[i].ServiceLatency,
+                sizeof(variableStatistics[i].ServiceLatency));
+    }
+
+    *BufferSize = sizeof(*statistics) +
+                  (statistics->VariableStatisticsCount * sizeof(*variableStatistics));
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the records of the variable names.
+ *
+ * @details The buffer is GET_VARIABLE_NAMES_HEADER followed by as many
+ *      records as it can hold.
+ */
+static
+EFI_STATUS
+HandleGetVariableNamesCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    GET_VARIABLE_NAMES_HEADER* header;
+    UINT32 count;
+    UINT32 cursor;
+    UINTN capacity;
+    UINTN copyCount;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(GET_VARIABLE_NAMES_HEADER)))
+    {
+        *BufferSize = sizeof(GET_VARIABLE_NAMES_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (GET_VARIABLE_NAMES_HEADER*)Buffer;
+    cursor = MAX(header->Cursor, 1);
+
+    //
+    // Records are written before Count is updated.
+    //
+    count = g_VariableNames->Count;
+    MemoryFence();
+
+    copyCount = 0;
+    if (cursor <= count)
+    {
+        capacity = (*BufferSize - sizeof(*header)) / sizeof(VARIABLE_NAME_RECORD);
+        copyCount = MIN(capacity, (UINTN)(count - cursor + 1));
+        if (copyCount == 0)
+        {
+            *BufferSize = sizeof(*header) + sizeof(VARIABLE_NAME_RECORD);
+            status = EFI_BUFFER_TOO_SMALL;
+            goto Exit;
+        }
+        CopyMem(header + 1,
+                &g_VariableNames->Records[cursor - 1],
+                copyCount * sizeof(VARIABLE_NAME_RECORD));
+    }
+
+    header->Cursor = cursor + (UINT32)copyCount;
+    header->EntryCount = (UINT32)copyCount;
+    header->Flags = (header->Cursor <= count) ? GET_VARIABLE_NAMES_FLAG_MORE_ENTRIES : 0;
+    header->Reserved = 0;
+    *BufferSize = sizeof(*header) + copyCount * sizeof(VARIABLE_NAME_RECORD);
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the aggregate statistics of the variables.
+ *
+ * @details The buffer is GET_AGGREGATES_HEADER followed by as many records as
+ *      it can hold.
+ */
+static
+EFI_STATUS
+HandleGetAggregatesCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    GET_AGGREGATES_HEADER* header;
+    VARIABLE_AGGREGATE_RECORD* records;
+    VARIABLE_STATISTICS* statistics;
+    UINT32 count;
+    UINT32 cursor;
+    UINTN capacity;
+    UINTN copyCount;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(GET_AGGREGATES_HEADER)))
+    {
+        *BufferSize = sizeof(GET_AGGREGATES_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (GET_AGGREGATES_HEADER*)Buffer;
+    records = (VARIABLE_AGGREGATE_RECORD*)(header + 1);
+    cursor = MAX(header->Cursor, 1);
+
+    //
+    // Records are written before Count is updated.
+    //
+    count = g_VariableNames->Count;
+    MemoryFence();
+
+    copyCount = 0;
+    if (cursor <= count)
+    {
+        capacity = (*BufferSize - sizeof(*header)) / sizeof(*records);
+        copyCount = MIN(capacity, (UINTN)(count - cursor + 1));
+        if (copyCount == 0)
+        {
+            *BufferSize = sizeof(*header) + sizeof(*records);
+            status = EFI_BUFFER_TOO_SMALL;
+            goto Exit;
+        }
+    }
+
+    for (UINTN i = 0; i < copyCount; i++)
+    {
+        records[i].Name = g_VariableNames->Records[cursor - 1 + i];
+
+        statistics = &g_VariableNames->Statistics[cursor - 1 + i];
+        AcquireSpinLockForNt(&statistics->Lock, &interruptState);
+        records[i].GetCount = statistics->GetCount;
+        records[i].SetCount = statistics->SetCount;
+        records[i].ErrorCount = statistics->ErrorCount;
+        records[i].BytesRead = statistics->BytesRead;
+        records[i].BytesWritten = statistics->BytesWritten;
+        records[i].SuppressedEntries = statistics->TotalSuppressedEntries;
+        records[i].RedundantWrites = statistics->RedundantWrites;
+        records[i].RedundantBytes = statistics->RedundantBytes;
+        records[i].LastStatus = statistics->LastStatus;
+        records[i].LastAttributes = statistics->LastAttributes;
+        ReleaseSpinLockForNt(&statistics->Lock, interruptState);
+        records[i].Reserved = 0;
+    }
+
+    header->Cursor = cursor + (UINT32)copyCount;
+    header->EntryCount = (UINT32)copyCount;
+    header->Flags = (header->Cursor <= count) ? GET_AGGREGATES_FLAG_MORE_ENTRIES : 0;
+    header->Reserved = 0;
+    *BufferSize = sizeof(*header) + copyCount * sizeof(*records);
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the names and contents of the variables in the store.
+ *
+ * @details The buffer is GET_SNAPSHOT_HEADER followed by as many snapshot
+ *      records as it can hold. The name and data of each variable are read
+ *      directly into the buffer, which also holds the name passed to
+ *      GetNextVariableName for the next variable. Variables Pre- Get callbacks
+ *      deny reading are skipped.
+ */
+static
+EFI_STATUS
+HandleGetSnapshotCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    GET_SNAPSHOT_HEADER* header;
+    SNAPSHOT_RECORD* record;
+    CONST CHAR16* previousName;
+    CONST EFI_GUID* previousGuid;
+    CHAR16* name;
+    UINTN previousNameSize;
+    UINTN nameSize;
+    UINTN dataOffset;
+    UINTN dataSize;
+    UINTN offset;
+    UINTN requiredSize;
+    UINT32 attributes;
+    UINT32 entryCount;
+    BOOLEAN moreEntries;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(GET_SNAPSHOT_HEADER)))
+    {
+        *BufferSize = sizeof(GET_SNAPSHOT_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (GET_SNAPSHOT_HEADER*)Buffer;
+    if (StrnLenS(header->Resume.VariableName, ARRAY_SIZE(header->Resume.VariableName)) ==
+        ARRAY_SIZE(header->Resume.VariableName))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    previousName = header->Resume.VariableName;
+    previousGuid = &header->Resume.VendorGuid;
+    offset = sizeof(*header);
+    requiredSize = 0;
+    entryCount = 0;
+    moreEntries = FALSE;
+
+    for (;;)
+    {
+        //
+        // Copy the previous name into the place of the next name, so that
+        // GetNextVariableName overwrites it in the buffer.
+        //
+        previousNameSize = StrSize(previousName);
+        if ((*BufferSize - offset) < (sizeof(*record) + previousNameSize))
+        {
+            requiredSize = offset + sizeof(*record) + previousNameSize;
+            moreEntries = TRUE;
+            status = EFI_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        record = (SNAPSHOT_RECORD*)((UINT8*)Buffer + offset);
+        name = (CHAR16*)(record + 1);
+        CopyMem(name, previousName, previousNameSize);
+        CopyGuid(&record->VendorGuid, previousGuid);
+
+        nameSize = *BufferSize - offset - sizeof(*record);
+        status = GetNextVariableNameThroughIndex(&nameSize, name, &record->VendorGuid);
+        if (status == EFI_NOT_FOUND)
+        {
+            status = EFI_SUCCESS;
+            break;
+        }
+        if (status == EFI_BUFFER_TOO_SMALL)
+        {
+            requiredSize = offset + sizeof(*record) + nameSize;
+            moreEntries = TRUE;
+            break;
+        }
+        if (EFI_ERROR(status))
+        {
+            moreEntries = TRUE;
+            break;
+        }
+
+        //
+        // The variable cannot be resumed from unless its name fits in the token.
+        //
+        if (nameSize > sizeof(header->Resume.VariableName))
+        {
+            status = EFI_UNSUPPORTED;
+            moreEntries = TRUE;
+            break;
+        }
+
+        //
+        // Skip the variable if callbacks deny reading it. The name stays in the
+        // buffer for GetNextVariableName, and is overwritten by the next one.
+        //
+        dataOffset = offset + sizeof(*record) + nameSize;
+        dataSize = *BufferSize - dataOffset;
+        if (InvokeGetCallbacksForCommand(name,
+                                         &record->VendorGuid,
+                                         dataSize,
+                                         (UINT8*)Buffer + dataOffset) == EFI_ACCESS_DENIED)
+        {
+            previousName = name;
+            previousGuid = &record->VendorGuid;
+            continue;
+        }
+
+        status = g_GetVariable(name,
+                               &record->VendorGuid,
+                               &attributes,
+                               &dataSize,
+                               (UINT8*)Buffer + dataOffset);
+        if (status == EFI_BUFFER_TOO_SMALL)
+        {
+            requiredSize = dataOffset + dataSize;
+            moreEntries = TRUE;
+            break;
+        }
+        if (EFI_ERROR(status))
+        {
+            moreEntries = TRUE;
+            break;
+        }
+
+        record->RecordSize = (UINT32)ALIGN_VALUE(sizeof(*record) + nameSize + dataSize, 8);
+        record->Attributes = attributes;
+        record->NameSize = (UINT32)nameSize;
+        record->DataSize = (UINT32)dataSize;
+
+        previousName = name;
+        previousGuid = &record->VendorGuid;
+        entryCount++;
+        offset = MIN(offset + record->RecordSize, *BufferSize);
+    }
+
+    //
+    // Return the error only if no variable was returned. Otherwise, the caller
+    // resumes from the last variable returned or skipped, and gets the error
+    // then.
+    //
+    if (entryCount == 0)
+    {
+        if (status == EFI_BUFFER_TOO_SMALL)
+        {
+            *BufferSize = requiredSize;
+        }
+        if (EFI_ERROR(status))
+        {
+            goto Exit;
+        }
+    }
+    if (previousName != header->Resume.VariableName)
+    {
+        CopyMem(header->Resume.VariableName, previousName, StrSize(previousName));
+        CopyGuid(&header->Resume.VendorGuid, previousGuid);
+    }
+
+    header->EntryCount = entryCount;
+    header->Flags = (moreEntries != FALSE) ? GET_SNAPSHOT_FLAG_MORE_ENTRIES : 0;
+    *BufferSize = offset;
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Reads the variables requested in the buffer.
+ */
+static
+EFI_STATUS
+HandleGetVariablesCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    GET_VARIABLES_HEADER* header;
+    GET_VARIABLES_REQUEST* requests;
+    GET_VARIABLES_RESULT* results;
+    UINTN dataOffset;
+    UINTN dataSize;
+    UINT32 attributes;
+    UINT64 tscStart;
+    UINT64 tscEnd;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(GET_VARIABLES_HEADER)))
+    {
+        *BufferSize = sizeof(GET_VARIABLES_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (GET_VARIABLES_HEADER*)Buffer;
+    if ((header->RequestCount == 0) ||
+        (header->RequestCount > MAX_GET_VARIABLES_REQUESTS))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    requests = (GET_VARIABLES_REQUEST*)(header + 1);
+    results = (GET_VARIABLES_RESULT*)(requests + header->RequestCount);
+    dataOffset = sizeof(*header) +
+                 (header->RequestCount * (sizeof(*requests) + sizeof(*results)));
+    if (*BufferSize < dataOffset)
+    {
+        *BufferSize = dataOffset;
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    for (UINT32 i = 0; i < header->RequestCount; i++)
+    {
+        if (StrnLenS(requests[i].VariableName, ARRAY_SIZE(requests[i].VariableName)) ==
+            ARRAY_SIZE(requests[i].VariableName))
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    //
+    // Read each variable into the rest of the buffer, in the same way as the
+    // GetVariable hook without Post- callbacks. The read denied by Pre-
+    // callbacks fails with EFI_ACCESS_DENIED and is not logged, as in the hook.
+    //
+    for (UINT32 i = 0; i < header->RequestCount; i++)
+    {
+        dataSize = *BufferSize - dataOffset;
+        if (InvokeGetCallbacksForCommand(requests[i].VariableName,
+                                         &requests[i].VendorGuid,
+                                         dataSize,
+                                         (UINT8*)Buffer + dataOffset) == EFI_ACCESS_DENIED)
+        {
+            ZeroMem(&results[i], sizeof(results[i]));
+            results[i].Status = EFI_ACCESS_DENIED;
+            continue;
+        }
+
+        tscStart = AsmReadTsc();
+        status = GetVariableThroughReadCache(requests[i].VariableName,
+                                             &requests[i].VendorGuid,
+                                             &attributes,
+                                             &dataSize,
+                                             (UINT8*)Buffer + dataOffset);
+        tscEnd = AsmReadTsc();
+
+        results[i].Status = status;
+        results[i].Attributes = EFI_ERROR(status) ? 0 : attributes;
+        results[i].DataSize = ((status == EFI_SUCCESS) || (status == EFI_BUFFER_TOO_SMALL)) ?
+                              (UINT32)dataSize : 0;
+        results[i].DataOffset = (status == EFI_SUCCESS) ? (UINT32)dataOffset : 0;
+        results[i].Reserved = 0;
+
+        AddLogEntryVariable(VariableCallbackGet,
+                            requests[i].VariableName,
+                            &requests[i].VendorGuid,
+                            results[i].Attributes,
+                            EFI_ERROR(status) ? 0 : dataSize,
+                            (UINT8*)Buffer + dataOffset,
+                            status,
+                            tscStart,
+                            tscEnd,
+                            0);
+
+        RecordCallStatistics(VariableCallbackGet,
+                             requests[i].VariableName,
+                             &requests[i].VendorGuid,
+                             results[i].Attributes,
+                             EFI_ERROR(status) ? 0 : dataSize,
+                             status,
+                             tscEnd - tscStart,
+                             AsmReadTsc() - tscEnd,
+                             0);
+
+        if (status == EFI_SUCCESS)
+        {
+            dataOffset = MIN(ALIGN_VALUE(dataOffset + dataSize, 8), *BufferSize);
+        }
+    }
+
+    *BufferSize = dataOffset;
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Replaces the watch list.
+ *
+ * @details The buffer is WATCH_LIST_HEADER followed by the entries. No entry
+ *      clears the watch list.
+ */
+static
+EFI_STATUS
+HandleSetWatchListCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    CONST WATCH_LIST_HEADER* header;
+    CONST WATCH_ENTRY* entries;
+    UINT32 variableIds[MAX_WATCH_ENTRIES];
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(WATCH_LIST_HEADER)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    header = (CONST WATCH_LIST_HEADER*)Buffer;
+    entries = (CONST WATCH_ENTRY*)(header + 1);
+    if (header->EntryCount > MAX_WATCH_ENTRIES)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    if (*BufferSize != (sizeof(*header) + (sizeof(*entries) * header->EntryCount)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    for (UINT32 i = 0; i < header->EntryCount; i++)
+    {
+        if (StrnLenS(entries[i].VariableName, ARRAY_SIZE(entries[i].VariableName)) ==
+            ARRAY_SIZE(entries[i].VariableName))
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    AcquireSpinLockForNt(&g_WatchList.Lock, &interruptState);
+
+    //
+    // Register the watched variables, so that SetVariable calls find them
+    // without the lock. This is done before the watch list is modified, so
+    // that the previous watch list stays intact on failure.
+    //
+    for (UINT32 i = 0; i < header->EntryCount; i++)
+    {
+        variableIds[i] = GetVariableId(entries[i].VariableName, &entries[i].VendorGuid);
+        if (variableIds[i] == VARIABLE_ID_UNKNOWN)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto ExitLocked;
+        }
+
+        for (UINT32 j = 0; j < i; j++)
+        {
+            if (variableIds[j] == variableIds[i])
+            {
+                status = EFI_INVALID_PARAMETER;
+                goto ExitLocked;
+            }
+        }
+    }
+
+    //
+    // Stop marking with the previous watch list while it is rebuilt. A call
+    // already past the check may still set a stale bit, which only makes the
+    // caller read the variable once more.
+    //
+    g_WatchList.Count = 0;
+    MemoryFence();
+    ZeroMem(g_WatchList.WatchIndexes, sizeof(g_WatchList.WatchIndexes));
+    for (UINT32 i = 0; i < header->EntryCount; i++)
+    {
+        g_WatchList.WatchIndexes[variableIds[i] - 1] = (UINT8)(i + 1);
+    }
+
+    g_WatchList.DirtyBitmap = (header->EntryCount == MAX_WATCH_ENTRIES) ?
+                              MAX_UINT64 :
+                              (LShiftU64(1, header->EntryCount) - 1);
+    MemoryFence();
+    g_WatchList.Count = header->EntryCount;
+    InterlockedIncrement(&g_WatchList.Generation);
+
+    status = EFI_SUCCESS;
+
+ExitLocked:
+    ReleaseSpinLockForNt(&g_WatchList.Lock, interruptState);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the dirty bitmap of the watch list, optionally clearing it.
+ */
+static
+EFI_STATUS
+HandleGetWatchStateCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    GET_WATCH_STATE* state;
+    UINT64 bitmap;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize != sizeof(GET_WATCH_STATE)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    state = (GET_WATCH_STATE*)Buffer;
+    if ((state->Flags & ~GET_WATCH_STATE_FLAG_CLEAR) != 0)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    //
+    // Read the generation before the bitmap. A bit set after this is returned
+    // now or later, and in either case, the generation returned next time is
+    // newer.
+    //
+    state->Generation = g_WatchList.Generation;
+    MemoryFence();
+    if ((state->Flags & GET_WATCH_STATE_FLAG_CLEAR) != 0)
+    {
+        do
+        {
+            bitmap = g_WatchList.DirtyBitmap;
+        } while (InterlockedCompareExchange64(&g_WatchList.DirtyBitmap,
+                                              bitmap,
+                                              0) != bitmap);
+    }
+    else
+    {
+        bitmap = g_WatchList.DirtyBitmap;
+    }
+    state->DirtyBitmap = bitmap;
+    state->EntryCount = g_WatchList.Count;
+    state->Reserved = 0;
+
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Returns the events queued for the deferred callback.
+ */
+static
+EFI_STATUS
+HandleDrainDeferredCallbacksCommand (
+    IN OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    DRAIN_DEFERRED_CALLBACKS_HEADER* header;
+    DEFERRED_CALLBACK_EVENT* events;
+    CONST CALLBACK_SET* currentSet;
+    DEFERRED_CALLBACK_QUEUE* queue;
+    UINTN capacity;
+    UINT32 eventCount;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(DRAIN_DEFERRED_CALLBACKS_HEADER)))
+    {
+        *BufferSize = sizeof(DRAIN_DEFERRED_CALLBACKS_HEADER);
+        status = EFI_BUFFER_TOO_SMALL;
+        goto Exit;
+    }
+
+    header = (DRAIN_DEFERRED_CALLBACKS_HEADER*)Buffer;
+    if (header->Callback == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    events = (DEFERRED_CALLBACK_EVENT*)(header + 1);
+    capacity = (*BufferSize - sizeof(*header)) / sizeof(*events);
+
+    //
+    // Find the queue of the callback. The lock of the callbacks keeps the queue
+    // from being freed by the UnregisterCallbacks command meanwhile.
+    //
+    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
+
+    queue = NULL;
+    currentSet = &g_CallbackSets[g_PublishedCallbackSetIndex];
+    for (UINTN i = 0; i < currentSet->Count; i++)
+    {
+        if (currentSet->Entries[i].Callback == header->Callback)
+        {
+            queue = currentSet->Entries[i].DeferredQueue;
+            break;
+        }
+    }
+    if (queue == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto ExitLocked;
+    }
+
+    //
+    // Copy the events of the callback in the queued order.
+    //
+    AcquireSpinLock(&queue->Lock);
+    eventCount = 0;
+    while ((eventCount < capacity) && (queue->Count != 0))
+    {
+        CopyMem(&events[eventCount], &queue->Events[queue->Head], sizeof(*events));
+        eventCount++;
+        queue->Head = (queue->Head + 1) % DEFERRED_CALLBACK_QUEUE_LENGTH;
+        queue->Count--;
+    }
+
+    header->EventCount = eventCount;
+    header->PendingEventCount = queue->Count;
+    header->DroppedEvents = queue->DroppedEvents;
+    ReleaseSpinLock(&queue->Lock);
+
+    *BufferSize = sizeof(*header) + (sizeof(*events) * eventCount);
+    status = EFI_SUCCESS;
+
+ExitLocked:
+    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Checks whether the variable matches the parameter of the
+ *      InvalidateReadCache command.
+ */
+static
+BOOLEAN
+IsReadCacheInvalidationMatched (
+    IN CONST READ_CACHE_INVALIDATION* Invalidation,
+    IN UINTN NameLength,
+    IN CONST CHAR16* VariableName,
+    IN CONST EFI_GUID* VendorGuid
+    )
+{
+    if (((Invalidation->Match & READ_CACHE_MATCH_VENDOR_GUID) != 0) &&
+        (CompareGuid(VendorGuid, &Invalidation->VendorGuid) == FALSE))
+    {
+        return FALSE;
+    }
+    if (((Invalidation->Match & READ_CACHE_MATCH_NAME) != 0) &&
+        (StrCmp(VariableName, Invalidation->Name) != 0))
+    {
+        return FALSE;
+    }
+    if (((Invalidation->Match & READ_CACHE_MATCH_NAME_PREFIX) != 0) &&
+        (StrnCmp(VariableName, Invalidation->Name, NameLength) != 0))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * @brief Invalidates the read cache and negative cache entries matching the
+ *      parameter.
+ */
+static
+EFI_STATUS
+HandleInvalidateReadCacheCommand (
+    IN VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    CONST READ_CACHE_INVALIDATION* invalidation;
+    READ_CACHE_ENTRY* entry;
+    NEGATIVE_CACHE_ENTRY* negativeEntry;
+    CONST VARIABLE_NAME_RECORD* record;
+    UINT32 validMatch;
+    UINT32 nameMatch;
+    UINTN nameLength;
+    UINTN interruptState;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize != sizeof(READ_CACHE_INVALIDATION)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    invalidation = (CONST READ_CACHE_INVALIDATION*)Buffer;
+    validMatch = (READ_CACHE_MATCH_VENDOR_GUID |
+                  READ_CACHE_MATCH_NAME |
+                  READ_CACHE_MATCH_NAME_PREFIX);
+    nameMatch = (invalidation->Match & (READ_CACHE_MATCH_NAME | READ_CACHE_MATCH_NAME_PREFIX));
+    nameLength = StrnLenS(invalidation->Name, ARRAY_SIZE(invalidation->Name));
+    if (((invalidation->Match & ~validMatch) != 0) ||
+        (nameMatch == (READ_CACHE_MATCH_NAME | READ_CACHE_MATCH_NAME_PREFIX)) ||
+        ((nameMatch != 0) && (nameLength == ARRAY_SIZE(invalidation->Name))))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    AcquireSpinLockForNt(&g_ReadCache->Lock, &interruptState);
+    for (UINTN i = 0; i < READ_CACHE_ENTRY_COUNT; i++)
+    {
+        entry = &g_ReadCache->Entries[i];
+        if (entry->VariableId == VARIABLE_ID_UNKNOWN)
+        {
+            continue;
+        }
+
+        record = &g_VariableNames->Records[entry->VariableId - 1];
+        if (IsReadCacheInvalidationMatched(invalidation,
+                                           nameLength,
+                                           record->VariableName,
+                                           &record->VendorGuid) != FALSE)
+        {
+            RemoveReadCacheEntry(entry);
+            g_ReadCache->Invalidations++;
+        }
+    }
+    for (UINTN i = 0; i < NEGATIVE_CACHE_ENTRY_COUNT; i++)
+    {
+        negativeEntry = &g_ReadCache->NotFound[i];
+        if ((negativeEntry->VariableName[0] != CHAR_NULL) &&
+            (IsReadCacheInvalidationMatched(invalidation,
+                                            nameLength,
+                                            negativeEntry->VariableName,
+                                            &negativeEntry->VendorGuid) != FALSE))
+        {
+            RemoveNotFoundEntry(negativeEntry);
+        }
+    }
+
+    //
+    // Discard the data being read, as it may be what the caller invalidated.
+    //
+    g_ReadCache->Generation++;
+    ReleaseSpinLockForNt(&g_ReadCache->Lock, interruptState);
+
+    *BufferSize = 0;
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Validates the rule of the log filter.
+ */
+static
+BOOLEAN
+IsLogFilterRuleValid (
+    IN CONST LOG_FILTER_RULE* Rule
+    )
+{
+    UINT32 validMatch;
+    UINT32 nameMatch;
+
+    validMatch = (LOG_FILTER_MATCH_VENDOR_GUID |
+                  LOG_FILTER_MATCH_NAME |
+                  LOG_FILTER_MATCH_NAME_PREFIX |
+                  LOG_FILTER_MATCH_ATTRIBUTES);
+    nameMatch = (Rule->Match & (LOG_FILTER_MATCH_NAME | LOG_FILTER_MATCH_NAME_PREFIX));
+
+    if (((Rule->Action != LogFilterInclude) && (Rule->Action != LogFilterExclude)) ||
+        (Rule->Match == 0) ||
+        ((Rule->Match & ~validMatch) != 0) ||
+        (nameMatch == (LOG_FILTER_MATCH_NAME | LOG_FILTER_MATCH_NAME_PREFIX)))
+    {
+        return FALSE;
+    }
+
+    if ((nameMatch != 0) &&
+        (StrnLenS(Rule->Name, ARRAY_SIZE(Rule->Name)) == ARRAY_SIZE(Rule->Name)))
+    {
+        return FALSE;
+    }
+
+    if (Rule->CaptureMode > CaptureModeDigest)
+    {
+        return FALSE;
+    }
+
+    //
+    // The rate limit must be able to pass at least one call.
+    //
+    if ((Rule->RateLimit != 0) && (Rule->RateBurst == 0))
+    {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Compiles the rules into the log filter.
+ */
+static
+VOID
+CompileLogFilter (
+    IN CONST LOG_FILTER_RULE* Rules,
+    IN UINT32 RuleCount,
+    OUT LOG_FILTER* Filter
+    )
+{
+    LOG_FILTER_ENTRY* entry;
+    UINT32 hash;
+    UINTN slotIndex;
+
+    ASSERT(RuleCount <= MAX_LOG_FILTER_RULES);
+
+    ZeroMem(Filter, sizeof(*Filter));
+    for (UINT32 i = 0; i < RuleCount; i++)
+    {
+        entry = &Filter->Entries[i];
+        CopyMem(&entry->Rule, &Rules[i], sizeof(entry->Rule));
+        entry->NameLength = StrnLenS(entry->Rule.Name, ARRAY_SIZE(entry->Rule.Name));
+
+        if (entry->Rule.Action == LogFilterInclude)
+        {
+            Filter->IncludeRuleCount++;
+        }
+
+        if ((entry->Rule.Match & LOG_FILTER_MATCH_NAME) == 0)
+        {
+            Filter->UnhashedRules[Filter->UnhashedRuleCount] = i;
+            Filter->UnhashedRuleCount++;
+            continue;
+        }
+
+        //
+        // Insert the rule into the first empty slot. The table never gets full
+        // as it has more slots than the maximum number of rules.
+        //
+        hash = HashVariableName(entry->Rule.Name);
+        slotIndex = hash & (LOG_FILTER_HASH_SIZE - 1);
+        while (Filter->Slots[slotIndex].RuleIndex != 0)
+        {
+            slotIndex = (slotIndex + 1) & (LOG_FILTER_HASH_SIZE - 1);
+        }
+        Filter->Slots[slotIndex].Hash = hash;
+        Filter->Slots[slotIndex].RuleIndex = i + 1;
+    }
+    Filter->RuleCount = RuleCount;
+}
+
+/**
+ * @brief Replaces the log filter.
+ *
+ * @details The buffer is LOG_FILTER_HEADER followed by the rules. No rule
+ *      disables filtering.
+ */
+static
+EFI_STATUS
+HandleSetLogFilterCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    CONST LOG_FILTER_HEADER* header;
+    CONST LOG_FILTER_RULE* rules;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize < sizeof(LOG_FILTER_HEADER)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    header = (CONST LOG_FILTER_HEADER*)Buffer;
+    rules = (CONST LOG_FILTER_RULE*)(header + 1);
+    if (header->RuleCount > MAX_LOG_FILTER_RULES)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    if (*BufferSize != (sizeof(*header) + (sizeof(*rules) * header->RuleCount)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    for (UINT32 i = 0; i < header->RuleCount; i++)
+    {
+        if (IsLogFilterRuleValid(&rules[i]) == FALSE)
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    //
+    // Make the version odd while the filter is being rebuilt, so that readers
+    // retry instead of using the partially built filter.
+    //
+    AcquireSpinLockForNt(&g_LogFilterLock, &interruptState);
+    InterlockedIncrement(&g_LogFilterVersion);
+    CompileLogFilter(rules, header->RuleCount, &g_LogFilter);
+    InterlockedIncrement(&g_LogFilterVersion);
+    ReleaseSpinLockForNt(&g_LogFilterLock, interruptState);
+
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Waits until no processor reads the callback set.
+ */
+static
+VOID
+WaitForCallbackSetReaders (
+    IN UINT32 CallbackSetIndex
+    )
+{
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        while (g_Processors[i].ReadingCallbackSet == (CallbackSetIndex + 1))
+        {
+            CpuPause();
+        }
+    }
+}
+
+/**
+ * @brief Publishes the callback set, and waits for the grace period of the
+ *      callback set previously published.
+ *
+ * @details After this function returns, no processor runs the callbacks in the
+ *      previous set, and the set can be rebuilt. The caller must hold
+ *      g_VariableCallbacksLock.
+ */
+static
+VOID
+PublishCallbackSet (
+    IN UINT32 CallbackSetIndex
+    )
+{
+    UINT32 previousIndex;
+
+    previousIndex = g_PublishedCallbackSetIndex;
+    InterlockedCompareExchange32(&g_PublishedCallbackSetIndex,
+                                 previousIndex,
+                                 CallbackSetIndex);
+    WaitForCallbackSetReaders(previousIndex);
+}
+
+/**
+ * @brief Makes sure the unpublished callback set can hold the entries.
+ *
+ * @details The entries are reallocated from the arena with the doubled
+ *      capacity. The contents are not preserved.
+ */
+static
+EFI_STATUS
+ReserveCallbackSet (
+    IN OUT CALLBACK_SET* CallbackSet,
+    IN UINTN Count
+    )
+{
+    EFI_STATUS status;
+    UINTN capacity;
+    CALLBACK_ENTRY* entries;
+
+    if (Count <= CallbackSet->Capacity)
+    {
+        status = EFI_SUCCESS;
+        goto Exit;
+    }
+
+    capacity = MAX(CallbackSet->Capacity, INITIAL_CALLBACK_SET_CAPACITY);
+    while (capacity < Count)
+    {
+        capacity *= 2;
+    }
+
+    entries = AllocateFromArena(capacity * sizeof(*entries));
+    if (entries == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        goto Exit;
+    }
+
+    if (CallbackSet->Entries != NULL)
+    {
+        FreeToArena(CallbackSet->Entries, CallbackSet->Capacity * sizeof(*entries));
+    }
+    CallbackSet->Entries = entries;
+    CallbackSet->Capacity = capacity;
+
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Converts the subscription into the entry of the callback set.
+ */
+static
+EFI_STATUS
+BuildCallbackEntry (
+    IN CONST VARIABLE_CALLBACK_SUBSCRIPTION* Subscription,
+    OUT CALLBACK_ENTRY* Entry
+    )
+{
+    EFI_STATUS status;
+    UINT32 callbackTypeMask;
+    UINT32 operationTypeMask;
+
+    callbackTypeMask = (CALLBACK_TYPE_MASK_GET | CALLBACK_TYPE_MASK_SET);
+    operationTypeMask = (OPERATION_TYPE_MASK_PRE | OPERATION_TYPE_MASK_POST);
+
+    if ((Subscription->Callback == NULL) ||
+        (Subscription->CallbackTypeMask == 0) ||
+        ((Subscription->CallbackTypeMask & ~callbackTypeMask) != 0) ||
+        (Subscription->OperationTypeMask == 0) ||
+        ((Subscription->OperationTypeMask & ~operationTypeMask) != 0) ||
+        ((Subscription->Filters & ~(SUBSCRIPTION_FILTER_VENDOR_GUID |
+                                    SUBSCRIPTION_FILTER_NAME_PREFIX)) != 0) ||
+        ((Subscription->Flags & ~SUBSCRIPTION_FLAG_DEFERRED) != 0))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    //
+    // Pre-calls cannot be deferred, as callbacks can change their outcome.
+    //
+    if (((Subscription->Flags & SUBSCRIPTION_FLAG_DEFERRED) != 0) &&
+        ((Subscription->OperationTypeMask & OPERATION_TYPE_MASK_PRE) != 0))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    ZeroMem(Entry, sizeof(*Entry));
+    Entry->Callback = Subscription->Callback;
+    Entry->Flags = Subscription->Flags;
+    Entry->Filters = Subscription->Filters;
+    Entry->Priority = Subscription->Priority;
+
+    //
+    // Expand the two masks into the bits of every subscribed pair.
+    //
+    for (UINT32 type = VariableCallbackGet; type <= VariableCallbackSet; type++)
+    {
+        for (UINT32 operation = OperationPre; operation <= OperationPost; operation++)
+        {
+            if (((Subscription->CallbackTypeMask & (1u << type)) != 0) &&
+                ((Subscription->OperationTypeMask & (1u << operation)) != 0))
+            {
+                Entry->SubscribedCalls |= CALLBACK_CALL_BIT(type, operation);
+            }
+        }
+    }
+
+    if ((Entry->Filters & SUBSCRIPTION_FILTER_VENDOR_GUID) != 0)
+    {
+        CopyGuid(&Entry->VendorGuid, &Subscription->VendorGuid);
+    }
+
+    if ((Entry->Filters & SUBSCRIPTION_FILTER_NAME_PREFIX) != 0)
+    {
+        Entry->NamePrefixLength = StrnLenS(Subscription->NamePrefix,
+                                           ARRAY_SIZE(Subscription->NamePrefix));
+        if (Entry->NamePrefixLength == ARRAY_SIZE(Subscription->NamePrefix))
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto Exit;
+        }
+        CopyMem(Entry->NamePrefix,
+                Subscription->NamePrefix,
+                Entry->NamePrefixLength * sizeof(CHAR16));
+    }
+
+    status = EFI_SUCCESS;
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Registers the callbacks of Get/SetVariable.
+ *
+ * @details The input is either VARIABLE_CALLBACK_SUBSCRIPTION, or
+ *      VARIABLE_CALLBACK, which subscribes all calls.
+ */
+static
+EFI_STATUS
+HandleRegisterCallbacksCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    VARIABLE_CALLBACK_SUBSCRIPTION subscription;
+    CALLBACK_ENTRY entry;
+    UINT32 newIndex;
+    CONST CALLBACK_SET* currentSet;
+    CALLBACK_SET* newSet;
+
+    if (Buffer == NULL)
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    if (*BufferSize == sizeof(VARIABLE_CALLBACK))
+    {
+        ZeroMem(&subscription, sizeof(subscription));
+        subscription.Callback = *(VARIABLE_CALLBACK*)Buffer;
+        subscription.CallbackTypeMask = (CALLBACK_TYPE_MASK_GET | CALLBACK_TYPE_MASK_SET);
+        subscription.OperationTypeMask = (OPERATION_TYPE_MASK_PRE | OPERATION_TYPE_MASK_POST);
+    }
+    else if (*BufferSize == sizeof(VARIABLE_CALLBACK_SUBSCRIPTION))
+    {
+        CopyMem(&subscription, Buffer, sizeof(subscription));
+    }
+    else
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    status = BuildCallbackEntry(&subscription, &entry);
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
+
+    currentSet = &g_CallbackSets[g_PublishedCallbackSetIndex];
+
+    //
+    // Return error if the same callback is already registered.
+    //
+    for (UINTN i = 0; i < currentSet->Count; i++)
+    {
+        if (currentSet->Entries[i].Callback == entry.Callback)
+        {
+            status = EFI_INVALID_PARAMETER;
+            goto ExitLocked;
+        }
+    }
+
+    //
+    // Return this error when the new set cannot be grown for the callback.
+    //
+    newIndex = g_PublishedCallbackSetIndex ^ 1;
+    newSet = &g_CallbackSets[newIndex];
+    status = ReserveCallbackSet(newSet, currentSet->Count + 1);
+    if (EFI_ERROR(status))
+    {
+        goto ExitLocked;
+    }
+
+    //
+    // Give the deferred callback its own queue of the events.
+    //
+    if ((entry.Flags & SUBSCRIPTION_FLAG_DEFERRED) != 0)
+    {
+        entry.DeferredQueue = AllocateFromArena(sizeof(*entry.DeferredQueue));
+        if (entry.DeferredQueue == NULL)
+        {
+            status = EFI_OUT_OF_RESOURCES;
+            goto ExitLocked;
+        }
+        ZeroMem(entry.DeferredQueue, OFFSET_OF(DEFERRED_CALLBACK_QUEUE, Events));
+        InitializeSpinLock(&entry.DeferredQueue->Lock);
+    }
+
+    //
+    // Build the new set with the callback inserted after the callbacks with the
+    // same or higher priority, and publish it.
+    //
+    newSet->Count = 0;
+    newSet->SubscribedCalls = (currentSet->SubscribedCalls | entry.SubscribedCalls);
+    for (UINTN i = 0; i < currentSet->Count; i++)
+    {
+        if ((newSet->Count == i) &&
+            (entry.Priority < currentSet->Entries[i].Priority))
+        {
+            newSet->Entries[newSet->Count] = entry;
+            newSet->Count++;
+        }
+        newSet->Entries[newSet->Count] = currentSet->Entries[i];
+        newSet->Count++;
+    }
+    if (newSet->Count == currentSet->Count)
+    {
+        newSet->Entries[newSet->Count] = entry;
+        newSet->Count++;
+    }
+    PublishCallbackSet(newIndex);
+
+    status = EFI_SUCCESS;
+
+ExitLocked:
+    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Unregisters the callback of Get/SetVariable.
+ *
+ * @details After this command returns, the callback is no longer running on
+ *      any processor. Hence, it must not be issued from the callback itself.
+ */
+static
+EFI_STATUS
+HandleUnregisterCallbacksCommand (
+    OUT VOID* Buffer OPTIONAL,
+    IN OUT UINTN* BufferSize
+    )
+{
+    EFI_STATUS status;
+    UINTN interruptState;
+    VARIABLE_CALLBACK callback;
+    UINT32 newIndex;
+    CONST CALLBACK_SET* currentSet;
+    CALLBACK_SET* newSet;
+    DEFERRED_CALLBACK_QUEUE* deferredQueue;
+
+    if ((Buffer == NULL) ||
+        (*BufferSize != sizeof(VARIABLE_CALLBACK)))
+    {
+        status = EFI_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    //
+    // Return this error when the callback is not registered.
+    //
+    status = EFI_INVALID_PARAMETER;
+    callback = *(VARIABLE_CALLBACK*)Buffer;
+
+    AcquireSpinLockForNt(&g_VariableCallbacksLock, &interruptState);
+
+    deferredQueue = NULL;
+    currentSet = &g_CallbackSets[g_PublishedCallbackSetIndex];
+    for (UINTN i = 0; i < currentSet->Count; i++)
+    {
+        if (currentSet->Entries[i].Callback == callback)
+        {
+            deferredQueue = currentSet->Entries[i].DeferredQueue;
+            status = EFI_SUCCESS;
+            break;
+        }
+    }
+    if (EFI_ERROR(status))
+    {
+        goto ExitLocked;
+    }
+
+    //
+    // Build the new set without the callback, and publish it. The new set was
+    // published with at least one less entry before, so it never has to grow.
+    //
+    newIndex = g_PublishedCallbackSetIndex ^ 1;
+    newSet = &g_CallbackSets[newIndex];
+    ASSERT(newSet->Capacity >= currentSet->Count - 1);
+    newSet->Count = 0;
+    newSet->SubscribedCalls = 0;
+    for (UINTN i = 0; i < currentSet->Count; i++)
+    {
+        if (currentSet->Entries[i].Callback == callback)
+        {
+            continue;
+        }
+        newSet->Entries[newSet->Count] = currentSet->Entries[i];
+        newSet->SubscribedCalls |= currentSet->Entries[i].SubscribedCalls;
+        newSet->Count++;
+    }
+
+    //
+    // Free the queue of the callback after no processor can queue more for it.
+    //
+    PublishCallbackSet(newIndex);
+    if (deferredQueue != NULL)
+    {
+        FreeToArena(deferredQueue, sizeof(*deferredQueue));
+    }
+
+ExitLocked:
+    ReleaseSpinLockForNt(&g_VariableCallbacksLock, interruptState);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Handles the backdoor command.
+ */
+static
+EFI_STATUS
+HandleBackdoorRequest (
+    IN CONST CHAR16* VariableName,
+    IN OUT VOID* Data OPTIONAL,
+    IN OUT UINTN* DataSize
+    )
+{
+    EFI_STATUS status;
+
+    if (StrCmp(VariableName, L"RegisterCallbacks") == 0)
+    {
+        status = HandleRegisterCallbacksCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"UnregisterCallbacks") == 0)
+    {
+        status = HandleUnregisterCallbacksCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"DrainBuffer") == 0)
+    {
+        status = HandleDrainBufferCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"DrainBufferEx") == 0)
+    {
+        status = HandleDrainBufferExCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"SetConfiguration") == 0)
+    {
+        status = HandleSetConfigurationCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetConfiguration") == 0)
+    {
+        status = HandleGetConfigurationCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetStats") == 0)
+    {
+        status = HandleGetStatsCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"SetLogFilter") == 0)
+    {
+        status = HandleSetLogFilterCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetVariableNames") == 0)
+    {
+        status = HandleGetVariableNamesCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetAggregates") == 0)
+    {
+        status = HandleGetAggregatesCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"InvalidateReadCache") == 0)
+    {
+        status = HandleInvalidateReadCacheCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetSnapshot") == 0)
+    {
+        status = HandleGetSnapshotCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetVariables") == 0)
+    {
+        status = HandleGetVariablesCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"SetWatchList") == 0)
+    {
+        status = HandleSetWatchListCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"GetWatchState") == 0)
+    {
+        status = HandleGetWatchStateCommand(Data, DataSize);
+    }
+    else if (StrCmp(VariableName, L"DrainDeferredCallbacks") == 0)
+    {
+        status = HandleDrainDeferredCallbacksCommand(Data, DataSize);
+    }
+    else
+    {
+        status = EFI_INVALID_PARAMETER;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Handles GetVariable runtime service calls.
+ */
+static
+EFI_STATUS
+EFIAPI
+HandleGetVariable (
+    IN CHAR16* VariableName,
+    IN EFI_GUID* VendorGuid,
+    OUT UINT32* Attributes OPTIONAL,
+    IN OUT UINTN* DataSize,
+    OUT VOID* Data OPTIONAL
+    )
+{
+    EFI_STATUS status;
+    UINTN effectiveDataSize;
+    UINT32 effectiveAttributes;
+    UINT64 hookStart;
+    UINT64 tscStart;
+    UINT64 tscEnd;
+    UINT64 callbackStart;
+    UINT64 callbackTicks;
+    CONST CHAR16* calledName;
+    CONST EFI_GUID* calledGuid;
+    UINT32 variableId;
+    UINT32 shadowGeneration;
+
+    //
+    // Only execute a backdoor command if the certain GUID is specified.
+    //
+    if (CompareGuid(VendorGuid, &g_BackdoorGuid) != FALSE)
+    {
+        status = HandleBackdoorRequest(VariableName, Data, DataSize);
+        goto Exit;
+    }
+
+    //
+    // Invoke Pre- Get callbacks. Callbacks can make the service call fail.
+    //
+    hookStart = AsmReadTsc();
+    status = InvokeGetCallbacks(OperationPre,
+                                &VariableName,
+                                &VendorGuid,
+                                &Attributes,
+                                &DataSize,
+                                &Data,
+                                NULL);
+    callbackTicks = AsmReadTsc() - hookStart;
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Invoke the original GetVariable service through the read cache, and log
+    // this service invocation.
+    //
+    shadowGeneration = BeginShadowRead(VariableName, VendorGuid, &variableId);
+    tscStart = AsmReadTsc();
+    status = GetVariableThroughReadCache(VariableName, VendorGuid, Attributes, DataSize, Data);
+    tscEnd = AsmReadTsc();
+    effectiveDataSize = EFI_ERROR(status) ? 0 : *DataSize;
+    effectiveAttributes = (EFI_ERROR(status) || (Attributes == NULL)) ? 0 : *Attributes;
+    AddLogEntryVariable(VariableCallbackGet,
+                        VariableName,
+                        VendorGuid,
+                        effectiveAttributes,
+                        effectiveDataSize,
+                        Data,
+                        status,
+                        tscStart,
+                        tscEnd,
+                        0);
+
+    //
+    // Learn the current value for the shadow digest. The attributes are part of
+    // the value, so the call without them cannot be used.
+    //
+    if ((status == EFI_SUCCESS) && (Attributes != NULL))
+    {
+        EndShadowRead(variableId, shadowGeneration, *Attributes, *DataSize, Data);
+    }
+
+    //
+    // Invoke Post- Get callbacks. Post callbacks cannot make the service fail.
+    // Keep the name and GUID given to the service as callbacks may change them.
+    //
+    calledName = VariableName;
+    calledGuid = VendorGuid;
+    callbackStart = AsmReadTsc();
+    InvokeGetCallbacks(OperationPost,
+                       &VariableName,
+                       &VendorGuid,
+                       &Attributes,
+                       &DataSize,
+                       &Data,
+                       &status);
+    callbackTicks += AsmReadTsc() - callbackStart;
+
+    RecordCallStatistics(VariableCallbackGet,
+                         calledName,
+                         calledGuid,
+                         effectiveAttributes,
+                         effectiveDataSize,
+                         status,
+                         tscEnd - tscStart,
+                         (AsmReadTsc() - hookStart) - (tscEnd - tscStart) - callbackTicks,
+                         callbackTicks);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Handles SetVariable runtime service calls.
+ */
+static
+EFI_STATUS
+EFIAPI
+HandleSetVariable (
+    IN CHAR16* VariableName,
+    IN EFI_GUID* VendorGuid,
+    IN UINT32 Attributes,
+    IN UINTN DataSize,
+    IN VOID* Data
+    )
+{
+    EFI_STATUS status;
+    UINT64 hookStart;
+    UINT64 tscStart;
+    UINT64 tscEnd;
+    UINT64 callbackStart;
+    UINT64 callbackTicks;
+    CONST CHAR16* calledName;
+    CONST EFI_GUID* calledGuid;
+    UINT32 calledAttributes;
+    UINTN calledDataSize;
+    SHADOW_UPDATE shadowUpdate;
+    UINT16 logFlags;
+    BOOLEAN nameIndexUpdating;
+
+    //
+    // Invoke Pre- Set callbacks. Callbacks can make the service call fail.
+    //
+    hookStart = AsmReadTsc();
+    status = ProcessSetCallbacks(OperationPre,
+                                 &VariableName,
+                                 &VendorGuid,
+                                 &Attributes,
+                                 &DataSize,
+                                 &Data,
+                                 NULL);
+    callbackTicks = AsmReadTsc() - hookStart;
+    if (EFI_ERROR(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Invoke the original SetVariable service unless the call is redundant and
+    // short-circuited, and log this service invocation. The short-circuited
+    // call leaves the read cache intact as the variable is not updated.
+    // Otherwise, the variable is invalidated in the read cache even if the call
+    // fails, as it may have been updated partially.
+    //
+    logFlags = 0;
+    if (BeginShadowUpdate(VariableName,
+                          VendorGuid,
+                          Attributes,
+                          DataSize,
+                          Data,
+                          &shadowUpdate) != FALSE)
+    {
+        logFlags |= LOG_ENTRY_FLAG_REDUNDANT_WRITE;
+    }
+
+    if (shadowUpdate.Skipped != FALSE)
+    {
+        logFlags |= LOG_ENTRY_FLAG_SHORT_CIRCUITED;
+        tscStart = AsmReadTsc();
+        status = EFI_SUCCESS;
+        tscEnd = tscStart;
+    }
+    else
+    {
+        BeginReadCacheUpdate(VariableName, VendorGuid);
+        nameIndexUpdating = BeginNameIndexUpdate();
+        tscStart = AsmReadTsc();
+        status = g_SetVariable(VariableName, VendorGuid, Attributes, DataSize, Data);
+        tscEnd = AsmReadTsc();
+        if (nameIndexUpdating != FALSE)
+        {
+            EndNameIndexUpdate(VariableName, VendorGuid, status);
+        }
+        EndReadCacheUpdate();
+        EndShadowUpdate(&shadowUpdate, Attributes, DataSize, status);
+        MarkWatchedVariableDirty(VariableName, VendorGuid);
+    }
+
+    AddLogEntryVariable(VariableCallbackSet,
+                        VariableName,
+                        VendorGuid,
+                        Attributes,
+                        DataSize,
+                        Data,
+                        status,
+                        tscStart,
+                        tscEnd,
+                        logFlags);
+
+    //
+    // Invoke Post- Set callbacks. Post callbacks cannot make the service fail.
+    // Keep the name and GUID given to the service as callbacks may change them.
+    //
+    calledName = VariableName;
+    calledGuid = VendorGuid;
+    calledAttributes = Attributes;
+    calledDataSize = DataSize;
+    callbackStart = AsmReadTsc();
+    ProcessSetCallbacks(OperationPost,
+                        &VariableName,
+                        &VendorGuid,
+                        &Attributes,
+                        &DataSize,
+                        &Data,
+                        &status);
+    callbackTicks += AsmReadTsc() - callbackStart;
+
+    RecordCallStatistics(VariableCallbackSet,
+                         calledName,
+                         calledGuid,
+                         calledAttributes,
+                         calledDataSize,
+                         status,
+                         tscEnd - tscStart,
+                         (AsmReadTsc() - hookStart) - (tscEnd - tscStart) - callbackTicks,
+                         callbackTicks);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Handles GetNextVariableName runtime service calls.
+ */
+static
+EFI_STATUS
+EFIAPI
+HandleGetNextVariableName (
+    IN OUT UINTN* VariableNameSize,
+    IN OUT CHAR16* VariableName,
+    IN OUT EFI_GUID* VendorGuid
+    )
+{
+    EFI_STATUS status;
+    UINT64 tscStart;
+    UINT64 tscEnd;
+
+    //
+    // Invoke the original GetNextVariableName service through the name index,
+    // and log this service invocation with the name returned, or the name given
+    // if the call failed. The name may not be terminated if the parameters are
+    // invalid, so such calls are not logged.
+    //
+    tscStart = AsmReadTsc();
+    status = GetNextVariableNameThroughIndex(VariableNameSize, VariableName, VendorGuid);
+    tscEnd = AsmReadTsc();
+    if ((status == EFI_INVALID_PARAMETER) ||
+        (VariableName == NULL) ||
+        (VendorGuid == NULL))
+    {
+        goto Exit;
+    }
+
+    AddLogEntryVariable(VariableCallbackGetNextName,
+                        VariableName,
+                        VendorGuid,
+                        0,
+                        0,
+                        NULL,
+                        status,
+                        tscStart,
+                        tscEnd,
+                        0);
+
+    RecordCallStatistics(VariableCallbackGetNextName,
+                         VariableName,
+                         VendorGuid,
+                         0,
+                         0,
+                         status,
+                         tscEnd - tscStart,
+                         AsmReadTsc() - tscEnd,
+                         0);
+
+Exit:
+    return status;
+}
+
+/**
+ * @brief Handles QueryVariableInfo runtime service calls.
+ */
+static
+EFI_STATUS
+EFIAPI
+HandleQueryVariableInfo (
+    IN UINT32 Attributes,
+    OUT UINT64* MaximumVariableStorageSize,
+    OUT UINT64* RemainingVariableStorageSize,
+    OUT UINT64* MaximumVariableSize
+    )
+{
+    EFI_STATUS status;
+    UINT64 tscStart;
+    UINT64 tscEnd;
+    UINT64 storageInfo[3];
+    UINTN storageInfoSize;
+    EFI_GUID vendorGuid;
+
+    //
+    // Invoke the original QueryVariableInfo service, and log this service
+    // invocation as the variable with the empty name and the zero GUID. The
+    // three sizes returned are logged as the data.
+    //
+    tscStart = AsmReadTsc();
+    status = g_QueryVariableInfo(Attributes,
+                                 MaximumVariableStorageSize,
+                                 RemainingVariableStorageSize,
+                                 MaximumVariableSize);
+    tscEnd = AsmReadTsc();
+
+    storageInfoSize = 0;
+    if (status == EFI_SUCCESS)
+    {
+        storageInfo[0] = *MaximumVariableStorageSize;
+        storageInfo[1] = *RemainingVariableStorageSize;
+        storageInfo[2] = *MaximumVariableSize;
+        storageInfoSize = sizeof(storageInfo);
+    }
+
+    ZeroMem(&vendorGuid, sizeof(vendorGuid));
+    AddLogEntryVariable(VariableCallbackQueryInfo,
+                        L"",
+                        &vendorGuid,
+                        Attributes,
+                        storageInfoSize,
+                        storageInfo,
+                        status,
+                        tscStart,
+                        tscEnd,
+                        0);
+
+    RecordCallStatistics(VariableCallbackQueryInfo,
+                         L"",
+                         &vendorGuid,
+                         Attributes,
+                         storageInfoSize,
+                         status,
+                         tscEnd - tscStart,
+                         AsmReadTsc() - tscEnd,
+                         0);
+
+    return status;
+}
+
+/**
+ * @brief Converts global pointers from physical-mode ones to virtual-mode ones.
+ */
+static
+VOID
+EFIAPI
+HandleSetVirtualAddressMap (
+    IN EFI_EVENT Event,
+    IN VOID* Context
+    )
+{
+    EFI_STATUS status;
+    VOID* currentAddress;
+
+    currentAddress = (VOID*)g_GetVariable;
+    status = gRT->ConvertPointer(0, (VOID**)&g_GetVariable);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "GetVariable relocated from %p to %p\n",
+           currentAddress,
+           g_GetVariable));
+
+    currentAddress = (VOID*)g_SetVariable;
+    status = gRT->ConvertPointer(0, (VOID**)&g_SetVariable);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "SetVariable relocated from %p to %p\n",
+           currentAddress,
+           g_SetVariable));
+
+    currentAddress = (VOID*)g_GetNextVariableName;
+    status = gRT->ConvertPointer(0, (VOID**)&g_GetNextVariableName);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "GetNextVariableName relocated from %p to %p\n",
+           currentAddress,
+           g_GetNextVariableName));
+
+    currentAddress = (VOID*)g_QueryVariableInfo;
+    status = gRT->ConvertPointer(0, (VOID**)&g_QueryVariableInfo);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "QueryVariableInfo relocated from %p to %p\n",
+           currentAddress,
+           g_QueryVariableInfo));
+
+    //
+    // Convert pointers in the processor contexts before the array itself, as
+    // the array is still accessed with the physical address.
+    //
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        for (UINTN j = 0; j < ARRAY_SIZE(g_Processors[i].LogRings); j++)
+        {
+            status = gRT->ConvertPointer(0, (VOID**)&g_Processors[i].LogRings[j].Buffer);
+            ASSERT_EFI_ERROR(status);
+        }
+    }
+
+    currentAddress = (VOID*)g_Arena.Base;
+    status = gRT->ConvertPointer(0, (VOID**)&g_Arena.Base);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "Arena relocated from %p to %p\n",
+           currentAddress,
+           g_Arena.Base));
+
+    currentAddress = (VOID*)g_Processors;
+    status = gRT->ConvertPointer(0, (VOID**)&g_Processors);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "Processors relocated from %p to %p\n",
+           currentAddress,
+           g_Processors));
+
+    currentAddress = (VOID*)g_VariableNames;
+    status = gRT->ConvertPointer(0, (VOID**)&g_VariableNames);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "VariableNames relocated from %p to %p\n",
+           currentAddress,
+           g_VariableNames));
+
+    currentAddress = (VOID*)g_ReadCache;
+    status = gRT->ConvertPointer(0, (VOID**)&g_ReadCache);
+    ASSERT_EFI_ERROR(status);
+    DEBUG((DEBUG_ERROR,
+           "ReadCache relocated from %p to %p\n",
+           currentAddress,
+           g_ReadCache));
+
+    for (UINTN i = 0; i < ARRAY_SIZE(g_CallbackSets); i++)
+    {
+        for (UINTN j = 0; j < g_CallbackSets[i].Count; j++)
+        {
+            if (g_CallbackSets[i].Entries[j].DeferredQueue != NULL)
+            {
+                status = gRT->ConvertPointer(
+                            0,
+                            (VOID**)&g_CallbackSets[i].Entries[j].DeferredQueue);
+                ASSERT_EFI_ERROR(status);
+            }
+        }
+
+        currentAddress = (VOID*)g_CallbackSets[i].Entries;
+        status = gRT->ConvertPointer(0, (VOID**)&g_CallbackSets[i].Entries);
+        ASSERT_EFI_ERROR(status);
+        DEBUG((DEBUG_ERROR,
+               "CallbackSets[%u] relocated from %p to %p\n",
+               (UINT32)i,
+               currentAddress,
+               g_CallbackSets[i].Entries));
+    }
+}
+
+/**
+ * @brief Exchanges a pointer in the EFI System Table.
+ */
+static
+EFI_STATUS
+ExchangePointerInServiceTable (
+    IN OUT VOID** AddressToUpdate,
+    IN VOID* NewPointer,
+    OUT VOID** OriginalPointer OPTIONAL
+    )
+{
+    EFI_STATUS status;
+    EFI_TPL tpl;
+
+    ASSERT(*AddressToUpdate != NewPointer);
+
+    tpl = gBS->RaiseTPL(TPL_HIGH_LEVEL);
+
+    //
+    // Save the current value if needed.
+    //
+    if (OriginalPointer != NULL)
+    {
+        *OriginalPointer = *AddressToUpdate;
+    }
+    *AddressToUpdate = NewPointer;
+
+    //
+    // Update the CRC32 in the EFI System Table header.
+    //
+    gST->Hdr.CRC32 = 0;
+    status = gBS->CalculateCrc32(&gST->Hdr, gST->Hdr.HeaderSize, &gST->Hdr.CRC32);
+    ASSERT_EFI_ERROR(status);
+
+    gBS->RestoreTPL(tpl);
+    return status;
+}
+
+/**
+ * @brief Cleans up changes made by this module and release resources.
+ *
+ * @details This function handles pertical clean up and is safe for multiple calls.
+ */
+static
+VOID
+Cleanup (
+    VOID
+    )
+{
+    EFI_STATUS status;
+
+    ASSERT(EfiAtRuntime() == FALSE);
+
+    if (gST->RuntimeServices->QueryVariableInfo == HandleQueryVariableInfo)
+    {
+        status = ExchangePointerInServiceTable(
+                                    (VOID**)&gST->RuntimeServices->QueryVariableInfo,
+                                    (VOID*)g_QueryVariableInfo,
+                                    NULL);
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (gST->RuntimeServices->GetNextVariableName == HandleGetNextVariableName)
+    {
+        status = ExchangePointerInServiceTable(
+                                    (VOID**)&gST->RuntimeServices->GetNextVariableName,
+                                    (VOID*)g_GetNextVariableName,
+                                    NULL);
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (gST->RuntimeServices->SetVariable == HandleSetVariable)
+    {
+        status = ExchangePointerInServiceTable(
+                                    (VOID**)&gST->RuntimeServices->SetVariable,
+                                    (VOID*)g_SetVariable,
+                                    NULL);
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (gST->RuntimeServices->GetVariable == HandleGetVariable)
+    {
+        status = ExchangePointerInServiceTable(
+                                    (VOID**)&gST->RuntimeServices->GetVariable,
+                                    (VOID*)g_GetVariable,
+                                    NULL);
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (g_BeforeExitBootServicesEvent != NULL)
+    {
+        status = gBS->CloseEvent(g_BeforeExitBootServicesEvent);
+        g_BeforeExitBootServicesEvent = NULL;
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (g_ReadyToBootEvent != NULL)
+    {
+        status = gBS->CloseEvent(g_ReadyToBootEvent);
+        g_ReadyToBootEvent = NULL;
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (g_SetVaMapEvent != NULL)
+    {
+        status = gBS->CloseEvent(&g_SetVaMapEvent);
+        g_SetVaMapEvent = NULL;
+        ASSERT_EFI_ERROR(status);
+    }
+
+    if (g_Processors != NULL)
+    {
+        for (UINTN i = 0; i < g_ProcessorCount; i++)
+        {
+            for (UINTN j = 0; j < ARRAY_SIZE(g_Processors[i].LogRings); j++)
+            {
+                if (g_Processors[i].LogRings[j].Buffer != NULL)
+                {
+                    FreePages(g_Processors[i].LogRings[j].Buffer,
+                              EFI_SIZE_TO_PAGES(g_Processors[i].LogRings[j].Size));
+                    g_Processors[i].LogRings[j].Buffer = NULL;
+                }
+            }
+        }
+        FreePool(g_Processors);
+        g_Processors = NULL;
+    }
+
+    if (g_VariableNames != NULL)
+    {
+        FreePool(g_VariableNames);
+        g_VariableNames = NULL;
+    }
+
+    if (g_ReadCache != NULL)
+    {
+        FreePages(g_ReadCache, EFI_SIZE_TO_PAGES(sizeof(*g_ReadCache)));
+        g_ReadCache = NULL;
+    }
+
+    //
+    // The callback sets are allocated from the arena, which is freed as a whole.
+    //
+    for (UINTN i = 0; i < ARRAY_SIZE(g_CallbackSets); i++)
+    {
+        g_CallbackSets[i].Entries = NULL;
+        g_CallbackSets[i].Capacity = 0;
+    }
+
+    if (g_Arena.Base != NULL)
+    {
+        FreePages(g_Arena.Base, ARENA_SIZE_IN_PAGES);
+        g_Arena.Base = NULL;
+    }
+}
+
+/**
+ * @brief Returns the size of each log ring in pages, configured with the
+ *      variable or the PCD.
+ */
+static
+UINTN
+GetLogRingSizeInPages (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    UINT32 sizeInPages;
+    UINTN dataSize;
+
+    //
+    // The variable overrides the PCD if it holds a valid size.
+    //
+    dataSize = sizeof(sizeInPages);
+    status = gRT->GetVariable(LOG_RING_SIZE_VARIABLE_NAME,
+                              (EFI_GUID*)&g_ConfigurationGuid,
+                              NULL,
+                              &dataSize,
+                              &sizeInPages);
+    if (status == EFI_SUCCESS)
+    {
+        if ((dataSize == sizeof(sizeInPages)) &&
+            (sizeInPages != 0) &&
+            (sizeInPages <= LOG_RING_MAX_SIZE_IN_PAGES))
+        {
+            return sizeInPages;
+        }
+        DEBUG((DEBUG_WARN, "Ignoring the invalid log ring size in the variable\n"));
+    }
+    else if (status != EFI_NOT_FOUND)
+    {
+        DEBUG((DEBUG_WARN, "GetVariable(%s) failed : %r\n", LOG_RING_SIZE_VARIABLE_NAME, status));
+    }
+
+    sizeInPages = PcdGet32(PcdLogRingSizeInPages);
+    return MIN(MAX(sizeInPages, 1), LOG_RING_MAX_SIZE_IN_PAGES);
+}
+
+/**
+ * @brief Returns the number of processors to allocate the contexts for.
+ */
+static
+UINTN
+GetProcessorCount (
+    VOID
+    )
+{
+    EFI_STATUS status;
+    EFI_MP_SERVICES_PROTOCOL* mpServices;
+    UINTN numberOfProcessors;
+    UINTN numberOfEnabledProcessors;
+
+    status = gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (VOID**)&mpServices);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "LocateProtocol(MpService) failed : %r\n", status));
+        return DEFAULT_PROCESSOR_COUNT;
+    }
+
+    status = mpServices->GetNumberOfProcessors(mpServices,
+                                               &numberOfProcessors,
+                                               &numberOfEnabledProcessors);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "GetNumberOfProcessors failed : %r\n", status));
+        return DEFAULT_PROCESSOR_COUNT;
+    }
+
+    //
+    // Include disabled processors too as they may be enabled later.
+    //
+    return numberOfProcessors;
+}
+
+/**
+ * @brief Returns the frequency of the TSC in Hz.
+ */
+static
+UINT64
+GetTscFrequency (
+    VOID
+    )
+{
+    UINT32 maxLeaf;
+    UINT32 denominator;
+    UINT32 numerator;
+    UINT32 crystalFrequency;
+    UINT64 tscStart;
+
+    //
+    // Use the ratio of the TSC to the crystal clock if CPUID.15h reports both.
+    //
+    AsmCpuid(0, &maxLeaf, NULL, NULL, NULL);
+    if (maxLeaf >= 0x15)
+    {
+        AsmCpuid(0x15, &denominator, &numerator, &crystalFrequency, NULL);
+        if ((denominator != 0) && (numerator != 0) && (crystalFrequency != 0))
+        {
+            return DivU64x32(MultU64x32(crystalFrequency, numerator), denominator);
+        }
+    }
+
+    //
+    // Otherwise, measure it against the Stall boot service.
+    //
+    tscStart = AsmReadTsc();
+    gBS->Stall(TSC_CALIBRATION_PERIOD_IN_US);
+    return MultU64x32(AsmReadTsc() - tscStart, 1000000 / TSC_CALIBRATION_PERIOD_IN_US);
+}
+
+/**
+ * @brief Initializes the header of drained buffers.
+ *
+ * @details The wall-clock time is taken only here, as the GetTime runtime
+ *      service cannot be called from the hooks.
+ */
+static
+VOID
+InitializeLogBufferHeader (
+    VOID
+    )
+{
+    EFI_STATUS status;
+
+    g_LogBufferHeader.Signature = LOG_BUFFER_SIGNATURE;
+    g_LogBufferHeader.Version = LOG_BUFFER_VERSION;
+    g_LogBufferHeader.HeaderSize = sizeof(g_LogBufferHeader);
+    g_LogBufferHeader.TscFrequency = GetTscFrequency();
+
+    status = gRT->GetTime(&g_LogBufferHeader.AnchorTime, NULL);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_WARN, "GetTime failed : %r\n", status));
+        ZeroMem(&g_LogBufferHeader.AnchorTime, sizeof(g_LogBufferHeader.AnchorTime));
+        return;
+    }
+    g_LogBufferHeader.AnchorTsc = AsmReadTsc();
+}
+
+/**
+ * @brief The module entry point.
+ */
+EFI_STATUS
+EFIAPI
+UefiVarMonitorDxeInitialize (
+    IN EFI_HANDLE ImageHandle,
+    IN EFI_SYSTEM_TABLE* SystemTable
+    )
+{
+    EFI_STATUS status;
+    UINT32 maxLeaf;
+    UINT32 ebx;
+    LOG_RING* ring;
+
+    InitializeSpinLock(&g_LogDrainLock);
+    InitializeSpinLock(&g_VariableCallbacksLock);
+    InitializeSpinLock(&g_LogFilterLock);
+    InitializeSpinLock(&g_VariableNamesLock);
+    InitializeSpinLock(&g_NameIndex.Lock);
+    InitializeSpinLock(&g_WatchList.Lock);
+    InitializeSpinLock(&g_Arena.Lock);
+
+    DEBUG((DEBUG_ERROR, "Driver being loaded\n"));
+
+    //
+    // Use the x2APIC ID to identify processors if CPUID.0Bh reports it.
+    //
+    AsmCpuid(0, &maxLeaf, NULL, NULL, NULL);
+    if (maxLeaf >= 0xb)
+    {
+        AsmCpuidEx(0xb, 0, NULL, &ebx, NULL, NULL);
+        g_X2ApicIdSupported = (ebx != 0);
+    }
+
+    InitializeLogBufferHeader();
+
+    //
+    // Allocate the processor contexts that are available for use even at the
+    // runtime phase. The contexts are claimed by processors on the first use.
+    //
+    g_ProcessorCount = GetProcessorCount();
+    g_Processors = AllocateRuntimeZeroPool(g_ProcessorCount * sizeof(*g_Processors));
+    if (g_Processors == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        DEBUG((DEBUG_ERROR, "AllocateRuntimeZeroPool failed\n"));
+        goto Exit;
+    }
+
+    //
+    // Allocate the log rings of each processor. They start small and grow up
+    // to the configured size on demand until ExitBootServices.
+    //
+    g_LogRingSizeInPages = GetLogRingSizeInPages();
+    DEBUG((DEBUG_INFO, "Log rings grow up to %u pages\n", (UINT32)g_LogRingSizeInPages));
+
+    for (UINTN i = 0; i < g_ProcessorCount; i++)
+    {
+        g_Processors[i].ApicId = UNOWNED_APIC_ID;
+        g_Processors[i].PendingSequenceNumber = MAX_UINT64;
+        for (UINTN j = 0; j < ARRAY_SIZE(g_Processors[i].LogRings); j++)
+        {
+            ring = &g_Processors[i].LogRings[j];
+            ring->Size = EFI_PAGES_TO_SIZE(MIN(LOG_RING_INITIAL_SIZE_IN_PAGES,
+                                               g_LogRingSizeInPages));
+            ring->Buffer = AllocateRuntimePages(EFI_SIZE_TO_PAGES(ring->Size));
+            if (ring->Buffer == NULL)
+            {
+                status = EFI_OUT_OF_RESOURCES;
+                DEBUG((DEBUG_ERROR, "AllocateRuntimePages failed\n"));
+                goto Exit;
+            }
+            ZeroMem(ring->Buffer, ring->Size);
+        }
+    }
+
+    //
+    // Allocate the variable name table referenced by log entries.
+    //
+    g_VariableNames = AllocateRuntimeZeroPool(sizeof(*g_VariableNames));
+    if (g_VariableNames == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        DEBUG((DEBUG_ERROR, "AllocateRuntimeZeroPool failed\n"));
+        goto Exit;
+    }
+
+    //
+    // Allocate the read cache. It is allocated even if disabled, as it can be
+    // enabled at runtime.
+    //
+    g_ReadCache = AllocateRuntimePages(EFI_SIZE_TO_PAGES(sizeof(*g_ReadCache)));
+    if (g_ReadCache == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        DEBUG((DEBUG_ERROR, "AllocateRuntimePages failed\n"));
+        goto Exit;
+    }
+    ZeroMem(g_ReadCache, sizeof(*g_ReadCache));
+    InitializeSpinLock(&g_ReadCache->Lock);
+
+    //
+    // Reserve the arena for the structures that grow at runtime.
+    //
+    g_Arena.Base = AllocateRuntimePages(ARENA_SIZE_IN_PAGES);
+    if (g_Arena.Base == NULL)
+    {
+        status = EFI_OUT_OF_RESOURCES;
+        DEBUG((DEBUG_ERROR, "AllocateRuntimePages failed\n"));
+        goto Exit;
+    }
+    g_Arena.Size = (UINT32)EFI_PAGES_TO_SIZE(ARENA_SIZE_IN_PAGES);
+
+    //
+    // Allocate the entries of both callback sets, so that they can be
+    // relocated. They grow on registration from the arena.
+    //
+    for (UINTN i = 0; i < ARRAY_SIZE(g_CallbackSets); i++)
+    {
+        status = ReserveCallbackSet(&g_CallbackSets[i], INITIAL_CALLBACK_SET_CAPACITY);
+        if (EFI_ERROR(status))
+        {
+            DEBUG((DEBUG_ERROR, "ReserveCallbackSet failed : %r\n", status));
+            goto Exit;
+        }
+    }
+
+    //
+    // Register a notification for SetVirtualAddressMap call.
+    //
+    status = gBS->CreateEventEx(EVT_NOTIFY_SIGNAL,
+                                TPL_CALLBACK,
+                                HandleSetVirtualAddressMap,
+                                NULL,
+                                &gEfiEventVirtualAddressChangeGuid,
+                                &g_SetVaMapEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "CreateEventEx failed : %r\n", status));
+        goto Exit;
+    }
+
+    //
+    // Register notifications to stop log rings from growing before the OS
+    // loader gets the memory map.
+    //
+    status = gBS->CreateEventEx(EVT_NOTIFY_SIGNAL,
+                                TPL_CALLBACK,
+                                FreezeLogRings,
+                                NULL,
+                                &gEfiEventReadyToBootGuid,
+                                &g_ReadyToBootEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "CreateEventEx failed : %r\n", status));
+        goto Exit;
+    }
+
+    status = gBS->CreateEventEx(EVT_NOTIFY_SIGNAL,
+                                TPL_CALLBACK,
+                                FreezeLogRings,
+                                NULL,
+                                &gEfiEventBeforeExitBootServicesGuid,
+                                &g_BeforeExitBootServicesEvent);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "CreateEventEx failed : %r\n", status));
+        goto Exit;
+    }
+
+    //
+    // Install hooks. At this point, everything that is used in the hook handlers
+    // must be initialized.
+    //
+    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->GetVariable,
+                                           (VOID*)HandleGetVariable,
+                                           (VOID**)&g_GetVariable);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(GetVariable) failed : %r\n", status));
+        goto Exit;
+    }
+    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->SetVariable,
+                                           (VOID*)HandleSetVariable,
+                                           (VOID**)&g_SetVariable);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(SetVariable) failed : %r\n", status));
+        goto Exit;
+    }
+    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->GetNextVariableName,
+                                           (VOID*)HandleGetNextVariableName,
+                                           (VOID**)&g_GetNextVariableName);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(GetNextVariableName) failed : %r\n", status));
+        goto Exit;
+    }
+    status = ExchangePointerInServiceTable((VOID**)&gST->RuntimeServices->QueryVariableInfo,
+                                           (VOID*)HandleQueryVariableInfo,
+                                           (VOID**)&g_QueryVariableInfo);
+    if (EFI_ERROR(status))
+    {
+        DEBUG((DEBUG_ERROR, "ExchangeTablePointer(QueryVariableInfo) failed : %r\n", status));
+        goto Exit;
+    }
+
+Exit:
+    if (EFI_ERROR(status))
+    {
+        Cleanup();
+    }
+    return status;
+}
+
+/**
+ * @brief Handles unload request of this module.
+ */
+EFI_STATUS
+EFIAPI
+UefiVarMonitorDxeUnload (
+    IN EFI_HANDLE ImageHandle
+    )
+{
+    Cleanup();
+    return EFI_SUCCESS;
+}
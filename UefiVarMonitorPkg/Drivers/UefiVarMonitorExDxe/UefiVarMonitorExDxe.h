@@ -1,113 +1,768 @@
-#ifndef __UEFI_VAR_MONITOR_EX_DXE_H__
-#define __UEFI_VAR_MONITOR_EX_DXE_H__
-
-#if defined(NTDDI_VERSION)
-
-//
-// For NT drivers.
-//
-#include <wdm.h>
-#define EFIAPI      __cdecl
-typedef WCHAR       CHAR16;
-typedef CHAR        CHAR8;
-typedef SIZE_T      EFI_STATUS;
-typedef SIZE_T      UINTN;
-
-#else
-
-//
-// For UEFI drivers.
-//
-#include <Uefi.h>
-
-#endif
-
-//
-// {3DEC99FB-86B4-4EED-B4D8-4E6ADDE56F95}
-//
-CONST GUID g_BackdoorGuid =
-{ 0x3dec99fb, 0x86b4, 0x4eed, { 0xb4, 0xd8, 0x4e, 0x6a, 0xdd, 0xe5, 0x6f, 0x95 } };
-
-typedef enum _VARIABLE_CALLBACK_TYPE
-{
-    VariableCallbackGet,
-    VariableCallbackSet,
-} VARIABLE_CALLBACK_TYPE;
-
-typedef enum _OPERATION_TYPE
-{
-    OperationPre,
-    OperationPost,
-} OPERATION_TYPE;
-
-//
-// The single log entry type in the log buffer.
-//
-#if defined(_MSC_VER)
-#pragma warning(push)
-#pragma warning(disable: 4200)
-#endif
-typedef struct _VARIABLE_LOG_ENTRY
-{
-    CHAR16 VariableName[64];
-    GUID VendorGuid;
-    VARIABLE_CALLBACK_TYPE CallbackType;
-    UINT32 Attributes;
-    EFI_STATUS Status;
-    CHAR8 StatusMessage[32];
-    UINTN DataSize;
-    UINT8 Data[0];
-} VARIABLE_LOG_ENTRY;
-#if defined(_MSC_VER)
-#pragma warning(pop)
-#endif
-
-//
-// The parameter type of the Get/SetVariable service callback.
-//
-typedef struct _VARIABLE_CALLBACK_PARAMETERS
-{
-    VARIABLE_CALLBACK_TYPE CallbackType;
-    OPERATION_TYPE OperationType;
-    union
-    {
-        struct
-        {
-            CHAR16** VariableName;  // Mutable
-            GUID** VendorGuid;      // Mutable
-            UINT32** Attributes;    // Mutable; (*Attributes) may be NULL
-            UINTN** DataSize;       // Mutable
-            VOID** Data;            // Mutable; (*Data) may be NULL
-            BOOLEAN Succeeded;      // Immutable
-            CHAR8* StatusMessage;   // Immutable
-        } Get;
-
-        struct
-        {
-            CHAR16** VariableName;  // Mutable
-            GUID** VendorGuid;      // Mutable
-            UINT32* Attributes;     // Mutable
-            UINTN* DataSize;        // Mutable
-            VOID** Data;            // Mutable
-            BOOLEAN Succeeded;      // Immutable
-            CHAR8* StatusMessage;   // Immutable
-        } Set;
-    } Parameters;
-} VARIABLE_CALLBACK_PARAMETERS;
-
-//
-// Get/SetVariable service callback type.
-//
-// The callbacks are allowed to modify values pointed from Parameters if it is
-// indicated as mutable.
-//
-// Returning TRUE on Pre-callback prevent the service to be executed.
-// On Post-callback, the return value is ignored.
-//
-typedef
-BOOLEAN
-(EFIAPI*VARIABLE_CALLBACK) (
-    IN OUT VARIABLE_CALLBACK_PARAMETERS* Parameters
-    );
-
-#endif
+#ifndef __UEFI_VAR_MONITOR_EX_DXE_H__
+#define __UEFI_VAR_MONITOR_EX_DXE_H__
+
+#if defined(NTDDI_VERSION)
+
+//
+// For NT drivers.
+//
+#include <wdm.h>
+#define EFIAPI      __cdecl
+typedef WCHAR       CHAR16;
+typedef CHAR        CHAR8;
+typedef SIZE_T      EFI_STATUS;
+typedef SIZE_T      UINTN;
+#define ARRAY_SIZE(Array)   RTL_NUMBER_OF(Array)
+
+typedef struct _EFI_TIME
+{
+    UINT16 Year;
+    UINT8 Month;
+    UINT8 Day;
+    UINT8 Hour;
+    UINT8 Minute;
+    UINT8 Second;
+    UINT8 Pad1;
+    UINT32 Nanosecond;
+    INT16 TimeZone;
+    UINT8 Daylight;
+    UINT8 Pad2;
+} EFI_TIME;
+
+#else
+
+//
+// For UEFI drivers.
+//
+#include <Uefi.h>
+
+#endif
+
+//
+// {3DEC99FB-86B4-4EED-B4D8-4E6ADDE56F95}
+//
+CONST GUID g_BackdoorGuid =
+{ 0x3dec99fb, 0x86b4, 0x4eed, { 0xb4, 0xd8, 0x4e, 0x6a, 0xdd, 0xe5, 0x6f, 0x95 } };
+
+//
+// {8C0B5E6A-2F71-4D3E-9A54-61C7D2B0E913}
+//
+CONST GUID g_ConfigurationGuid =
+{ 0x8c0b5e6a, 0x2f71, 0x4d3e, { 0x9a, 0x54, 0x61, 0xc7, 0xd2, 0xb0, 0xe9, 0x13 } };
+
+//
+// The UINT32 variable under g_ConfigurationGuid overriding the size of each log
+// ring in pages. It is read when the driver is loaded, and takes precedence over
+// PcdLogRingSizeInPages.
+//
+#define LOG_RING_SIZE_VARIABLE_NAME     L"LogRingSizeInPages"
+
+//
+// The types of the services monitored. Callbacks are invoked only for
+// VariableCallbackGet and VariableCallbackSet, and the rest are only logged.
+//
+typedef enum _VARIABLE_CALLBACK_TYPE
+{
+    VariableCallbackGet,
+    VariableCallbackSet,
+    VariableCallbackGetNextName,
+    VariableCallbackQueryInfo,
+} VARIABLE_CALLBACK_TYPE;
+
+#define VARIABLE_SERVICE_COUNT          4
+
+//
+// The letters representing VARIABLE_CALLBACK_TYPE in the printed logs.
+//
+#define VARIABLE_CALLBACK_TYPE_LETTERS  "GSNQ"
+
+typedef enum _OPERATION_TYPE
+{
+    OperationPre,
+    OperationPost,
+} OPERATION_TYPE;
+
+//
+// Returns the human readable string of the status code, which is the same as
+// one printed with %r by PrintLib. Log entries and callback parameters carry
+// raw status codes, so that the string is resolved only when it is needed.
+//
+static
+__inline
+CONST CHAR8*
+GetStatusMessage (
+    IN EFI_STATUS Status
+    )
+{
+    static CONST CHAR8* CONST warningMessages[] =
+    {
+        "Success",
+        "Warning Unknown Glyph",
+        "Warning Delete Failure",
+        "Warning Write Failure",
+        "Warning Buffer Too Small",
+        "Warning Stale Data",
+        "Warning File System",
+        "Warning Reset Required",
+    };
+    static CONST CHAR8* CONST errorMessages[] =
+    {
+        "Unknown Error",
+        "Load Error",
+        "Invalid Parameter",
+        "Unsupported",
+        "Bad Buffer Size",
+        "Buffer Too Small",
+        "Not Ready",
+        "Device Error",
+        "Write Protected",
+        "Out of Resources",
+        "Volume Corrupt",
+        "Volume Full",
+        "No Media",
+        "Media changed",
+        "Not Found",
+        "Access Denied",
+        "No Response",
+        "No mapping",
+        "Time out",
+        "Not started",
+        "Already started",
+        "Aborted",
+        "ICMP Error",
+        "TFTP Error",
+        "Protocol Error",
+        "Incompatible Version",
+        "Security Violation",
+        "CRC Error",
+        "End of Media",
+        "Reserved (29)",
+        "Reserved (30)",
+        "End of File",
+        "Invalid Language",
+        "Compromised Data",
+        "IP Address Conflict",
+        "HTTP Error",
+    };
+    static CONST EFI_STATUS errorBit = (EFI_STATUS)1 << (sizeof(EFI_STATUS) * 8 - 1);
+    EFI_STATUS code;
+
+    code = Status & ~errorBit;
+    if ((Status & errorBit) != 0)
+    {
+        return (code < ARRAY_SIZE(errorMessages)) ? errorMessages[code] : "Unknown Error";
+    }
+    return (code < ARRAY_SIZE(warningMessages)) ? warningMessages[code] : "Unknown Warning";
+}
+
+//
+// The behaviors of the log buffer when it is full.
+//
+typedef enum _LOG_MODE
+{
+    LogModeDiscardNewest,       // Discards new entries (default)
+    LogModeOverwriteOldest,     // Overwrites the oldest entries with new ones
+    LogModeAggregateOnly,       // Adds no entries, and only updates aggregates
+} LOG_MODE;
+
+//
+// How much of the variable data is logged. CaptureModeDefault follows the
+// global setting when specified for a log filter rule, and is the same as
+// CaptureModeFull when specified globally.
+//
+typedef enum _CAPTURE_MODE
+{
+    CaptureModeDefault,
+    CaptureModeFull,            // Logs all data
+    CaptureModeNone,            // Logs no data
+    CaptureModeTruncate,        // Logs up to CaptureSize bytes of data
+    CaptureModeDigest,          // Logs the 64-bit FNV-1a digest of data
+} CAPTURE_MODE;
+
+//
+// Serves GetVariable calls from the read cache, which holds copies of the data
+// of variables read before instead of calling the original service. Variables
+// are invalidated in the cache when SetVariable is called for them, and by the
+// InvalidateReadCache command. This is opt-in, as the cache returns stale data
+// for variables updated without going through this module, for example, by
+// SMM or through a pointer to SetVariable saved before this module is loaded.
+//
+#define MONITOR_FLAG_READ_CACHE         0x1
+
+//
+// Answers GetVariable calls for variables the original service returned
+// EFI_NOT_FOUND for before, without calling the service again. The results are
+// invalidated in the same way as the read cache, and the same caveat applies.
+//
+#define MONITOR_FLAG_NEGATIVE_CACHE     0x2
+
+//
+// Detects SetVariable calls writing the same attributes and data as the current
+// value of the variable, by comparing them with the shadow digest of the value
+// last read or written through this module. Such calls are counted per variable
+// and flagged in the log entries. With MONITOR_FLAG_SKIP_REDUNDANT_WRITES, they
+// are also completed with EFI_SUCCESS without calling the original service.
+//
+// Appending and authenticated writes are never considered redundant. The
+// digest is 64-bit FNV-1a and not collision-resistant, so before a call is
+// short-circuited, its data is also compared with the current value read back
+// from the original service. Calls with more than 1024 bytes of data are never
+// short-circuited. The same caveat as the read cache applies to variables
+// updated without going through this module.
+//
+#define MONITOR_FLAG_DETECT_REDUNDANT_WRITES    0x4
+#define MONITOR_FLAG_SKIP_REDUNDANT_WRITES      0x8
+
+//
+// Answers GetNextVariableName calls from the name index, which lists all
+// variables sorted by the vendor GUID and the name, instead of calling the
+// original service. The index is built on the first call of an enumeration
+// and is kept in sync by the SetVariable hook, and the same caveat as the read
+// cache applies. The index is not used if any variable name is longer than
+// VARIABLE_NAME_RECORD can hold or the variable name table gets full.
+//
+#define MONITOR_FLAG_NAME_INDEX                 0x10
+
+//
+// The parameter type of the SetConfiguration and GetConfiguration commands.
+//
+typedef struct _MONITOR_CONFIGURATION
+{
+    UINT32 LogMode;             // LOG_MODE
+    UINT32 CaptureMode;         // CAPTURE_MODE
+    UINT32 CaptureSize;         // Valid if CaptureModeTruncate
+    UINT32 Flags;               // MONITOR_FLAG_*
+} MONITOR_CONFIGURATION;
+
+//
+// The parameter type of the InvalidateReadCache command. Invalidates the
+// entries of the variables matching all conditions specified with Match, or
+// all entries if Match is 0, both in the read cache and the negative cache.
+// READ_CACHE_MATCH_NAME and READ_CACHE_MATCH_NAME_PREFIX are mutually
+// exclusive.
+//
+#define READ_CACHE_MATCH_VENDOR_GUID    0x1
+#define READ_CACHE_MATCH_NAME           0x2
+#define READ_CACHE_MATCH_NAME_PREFIX    0x4
+
+typedef struct _READ_CACHE_INVALIDATION
+{
+    UINT32 Match;               // READ_CACHE_MATCH_*
+    UINT32 Reserved;
+    GUID VendorGuid;
+    CHAR16 Name[64];            // NULL-terminated
+} READ_CACHE_INVALIDATION;
+
+//
+// Latency histograms count calls by the log2 of the time taken in TSC ticks.
+// Bucket N counts calls that took [2^N, 2^(N+1)) ticks, except that the first
+// bucket also counts zero and the last bucket also counts anything longer.
+// Histograms are indexed by VARIABLE_CALLBACK_TYPE first.
+//
+#define LATENCY_HISTOGRAM_BUCKETS       32
+
+//
+// The result type of the GetStats command. As many VARIABLE_LATENCY_STATISTICS
+// as the buffer can hold follow this structure, in the order of the variable ID.
+// Variables may be added between the call to get the size and the next call,
+// so VariableStatisticsCount may be less than VariableCount.
+//
+typedef struct _MONITOR_STATISTICS
+{
+    UINT64 LogRingCount;        // The number of per-processor log rings
+    UINT64 LogRingSize;         // The size each log ring can grow up to in bytes
+    UINT64 LogHighWaterMark;    // The highest usage of any log ring in bytes
+    UINT64 DroppedEntries;      // Entries discarded as the ring was full
+    UINT64 OverwrittenEntries;  // Entries overwritten before being drained
+    UINT64 TscFrequency;        // Ticks per second; 0 if unknown
+    UINT64 ReadCacheHits;       // GetVariable calls served from the read cache
+    UINT64 ReadCacheMisses;     // GetVariable calls passed down with the read cache
+    UINT64 ReadCacheEvictions;  // Read cache entries evicted for other variables
+    UINT64 ReadCacheInvalidations; // Read cache entries invalidated
+    UINT64 NegativeCacheHits;   // GetVariable calls answered EFI_NOT_FOUND from the negative cache
+    UINT64 NegativeCacheInsertions; // Variables recorded as not found
+    UINT64 NegativeCacheInvalidations; // Variables invalidated in the negative cache
+    UINT64 NameIndexHits;       // GetNextVariableName calls answered from the name index
+    UINT64 NameIndexBuilds;     // Times the name index was built
+
+    //
+    // The time spent in the original services, in this module excluding the
+    // services and callbacks, and in Pre- and Post-callbacks.
+    //
+    UINT64 ServiceLatency[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+    UINT64 HookLatency[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+    UINT64 CallbackLatency[VARIABLE_SERVICE_COUNT][LATENCY_HISTOGRAM_BUCKETS];
+
+    UINT32 VariableCount;       // The number of variables with statistics
+    UINT32 VariableStatisticsCount; // The number of VARIABLE_LATENCY_STATISTICS returned
+} MONITOR_STATISTICS;
+
+//
+// The time spent in the original GetVariable and SetVariable services for the
+// variable.
+//
+typedef struct _VARIABLE_LATENCY_STATISTICS
+{
+    UINT32 VariableId;
+    UINT32 Reserved;
+    UINT32 ServiceLatency[2][LATENCY_HISTOGRAM_BUCKETS];
+} VARIABLE_LATENCY_STATISTICS;
+
+//
+// The header at the beginning of every buffer returned by the drain commands.
+// The TSC values in log entries are converted to the wall-clock time with the
+// anchor and the frequency, assuming the TSC is invariant.
+//
+#define LOG_BUFFER_SIGNATURE            0x4c4d5655  // 'UVML'
+#define LOG_BUFFER_VERSION              2
+
+typedef struct _LOG_BUFFER_HEADER
+{
+    UINT32 Signature;           // LOG_BUFFER_SIGNATURE
+    UINT16 Version;             // LOG_BUFFER_VERSION
+    UINT16 HeaderSize;          // sizeof(LOG_BUFFER_HEADER)
+    UINT64 TscFrequency;        // Ticks per second; 0 if unknown
+    UINT64 AnchorTsc;           // The TSC value when AnchorTime was taken; 0 if unknown
+    EFI_TIME AnchorTime;        // The wall-clock time when the driver was loaded
+} LOG_BUFFER_HEADER;
+
+//
+// The header of the buffer for the DrainBufferEx command. Log entries follow
+// the header.
+//
+// Cursor is the sequence number of the next entry the caller wants to receive.
+// Entries with lower sequence numbers are discarded. On return, it is updated
+// to the value to pass to the next command. LostEntries is the number of
+// entries discarded or overwritten before they could be drained.
+//
+#define DRAIN_BUFFER_EX_FLAG_MORE_ENTRIES   0x1
+
+typedef struct _DRAIN_BUFFER_EX_HEADER
+{
+    LOG_BUFFER_HEADER Log;      // [Out]
+    UINT64 Cursor;              // [In/Out]
+    UINT64 LostEntries;         // [Out]
+    UINT32 EntryCount;          // [Out]
+    UINT32 Flags;               // [Out] DRAIN_BUFFER_EX_FLAG_*
+    UINT64 Reserved;
+} DRAIN_BUFFER_EX_HEADER;
+
+//
+// The rule of the log filter. A rule matches a call when all of the selected
+// conditions are met.
+//
+// A call is logged when it matches no exclude rule, and either matches any of
+// include rules or there is no include rule. Hence, the empty filter logs all
+// calls.
+//
+// The capture mode of the first include rule that matches and does not specify
+// CaptureModeDefault overrides the global one. Likewise, the sampling and the
+// rate limit are taken from the first matched include rule that specifies them.
+// Sampling is applied before the rate limit. Calls suppressed by them are still
+// counted in the aggregate statistics, and the number of calls suppressed since
+// the previous entry of the variable is reported with the next entry.
+//
+typedef enum _LOG_FILTER_ACTION
+{
+    LogFilterInclude,
+    LogFilterExclude,
+} LOG_FILTER_ACTION;
+
+#define LOG_FILTER_MATCH_VENDOR_GUID    0x1     // VendorGuid must match
+#define LOG_FILTER_MATCH_NAME           0x2     // VariableName must equal Name
+#define LOG_FILTER_MATCH_NAME_PREFIX    0x4     // VariableName must start with Name
+#define LOG_FILTER_MATCH_ATTRIBUTES     0x8     // (Attributes & AttributesMask) must equal AttributesValue
+
+typedef struct _LOG_FILTER_RULE
+{
+    UINT32 Action;              // LOG_FILTER_ACTION
+    UINT32 Match;               // LOG_FILTER_MATCH_*
+    GUID VendorGuid;
+    UINT32 AttributesMask;
+    UINT32 AttributesValue;
+    UINT32 CaptureMode;         // CAPTURE_MODE; ignored for exclude rules
+    UINT32 CaptureSize;         // Valid if CaptureModeTruncate
+    UINT32 SampleInterval;      // Logs 1 in N calls per variable; 0 or 1 to log all
+    UINT32 RateLimit;           // Logs up to N calls per second per variable; 0 for no limit
+    UINT32 RateBurst;           // Calls logged in a row before the rate limit applies
+    UINT32 Reserved;
+    CHAR16 Name[64];            // NULL-terminated
+} LOG_FILTER_RULE;
+
+//
+// The parameter type of the SetLogFilter command. The command replaces the
+// current filter with RuleCount rules that follow the header.
+//
+#define MAX_LOG_FILTER_RULES            64
+
+typedef struct _LOG_FILTER_HEADER
+{
+    UINT32 RuleCount;
+    UINT32 Reserved;
+} LOG_FILTER_HEADER;
+
+//
+// The identifier of the pair of the vendor GUID and the variable name. Log
+// entries carry it in place of the pair, and the GetVariableNames command
+// returns the pair for it. IDs are assigned from 1 in the order the pairs are
+// first logged, and never reused. VARIABLE_ID_UNKNOWN is used once
+// MAX_VARIABLE_NAMES pairs are registered.
+//
+// Names are truncated to fit in VARIABLE_NAME_RECORD, and names sharing the
+// truncated part share the ID.
+//
+#define MAX_VARIABLE_NAMES              512
+#define VARIABLE_ID_UNKNOWN             0
+
+typedef struct _VARIABLE_NAME_RECORD
+{
+    UINT32 VariableId;
+    UINT32 Reserved;
+    GUID VendorGuid;
+    CHAR16 VariableName[64];
+} VARIABLE_NAME_RECORD;
+
+//
+// The header of the buffer for the GetVariableNames command. Name records
+// follow the header.
+//
+// Cursor is the ID of the first record the caller wants to receive. On return,
+// it is updated to the value to pass to the next command.
+//
+#define GET_VARIABLE_NAMES_FLAG_MORE_ENTRIES    0x1
+
+typedef struct _GET_VARIABLE_NAMES_HEADER
+{
+    UINT32 Cursor;              // [In/Out]
+    UINT32 EntryCount;          // [Out]
+    UINT32 Flags;               // [Out] GET_VARIABLE_NAMES_FLAG_*
+    UINT32 Reserved;
+} GET_VARIABLE_NAMES_HEADER;
+
+//
+// The aggregate statistics of the variable returned by the GetAggregates
+// command. They are updated regardless of the log mode, and each record is
+// read atomically with respect to the calls updating it.
+//
+typedef struct _VARIABLE_AGGREGATE_RECORD
+{
+    VARIABLE_NAME_RECORD Name;
+    UINT64 GetCount;
+    UINT64 SetCount;
+    UINT64 ErrorCount;          // Calls that returned an error
+    UINT64 BytesRead;           // Data returned by successful GetVariable calls
+    UINT64 BytesWritten;        // Data given to successful SetVariable calls
+    UINT64 SuppressedEntries;   // Calls not logged by the sampling or the rate limit
+    UINT64 RedundantWrites;     // SetVariable calls writing the current value
+    UINT64 RedundantBytes;      // Data given to the redundant SetVariable calls
+    UINT64 LastStatus;          // EFI_STATUS of the last call
+    UINT32 LastAttributes;      // Attributes of the last successful SetVariable call
+    UINT32 Reserved;
+} VARIABLE_AGGREGATE_RECORD;
+
+//
+// The header of the buffer for the GetAggregates command. Aggregate records
+// follow the header. Cursor is used in the same way as GetVariableNames.
+//
+#define GET_AGGREGATES_FLAG_MORE_ENTRIES    0x1
+
+typedef struct _GET_AGGREGATES_HEADER
+{
+    UINT32 Cursor;              // [In/Out]
+    UINT32 EntryCount;          // [Out]
+    UINT32 Flags;               // [Out] GET_AGGREGATES_FLAG_*
+    UINT32 Reserved;
+} GET_AGGREGATES_HEADER;
+
+//
+// The header of the buffer for the GetSnapshot command. Snapshot records of
+// variables follow the header in the order of GetNextVariableName.
+//
+// Resume is the resume token: the variable after which the caller wants to
+// receive records, or the empty name to start from the first variable. On
+// return, it is updated to the last variable returned. The command may fail
+// with EFI_INVALID_PARAMETER if the variable of the token is deleted, in which
+// case the caller starts over.
+//
+// Variables registered Pre- Get callbacks deny reading are skipped, as if they
+// were read through GetVariable. The resume token may name such a variable.
+//
+#define GET_SNAPSHOT_FLAG_MORE_ENTRIES  0x1
+#define SNAPSHOT_MAX_NAME_LENGTH        512
+
+typedef struct _SNAPSHOT_RESUME_TOKEN
+{
+    GUID VendorGuid;
+    CHAR16 VariableName[SNAPSHOT_MAX_NAME_LENGTH];  // NULL-terminated
+} SNAPSHOT_RESUME_TOKEN;
+
+typedef struct _GET_SNAPSHOT_HEADER
+{
+    SNAPSHOT_RESUME_TOKEN Resume;   // [In/Out]
+    UINT32 EntryCount;          // [Out]
+    UINT32 Flags;               // [Out] GET_SNAPSHOT_FLAG_*
+} GET_SNAPSHOT_HEADER;
+
+//
+// The snapshot record of the variable. The NULL-terminated variable name of
+// NameSize bytes and the data of DataSize bytes follow the record. RecordSize
+// includes them and is a multiple of 8, so that the next record is naturally
+// aligned as well.
+//
+typedef struct _SNAPSHOT_RECORD
+{
+    UINT32 RecordSize;
+    UINT32 Attributes;
+    GUID VendorGuid;
+    UINT32 NameSize;
+    UINT32 DataSize;
+} SNAPSHOT_RECORD;
+
+//
+// The buffer for the GetVariables command, which calls GetVariable for each
+// request in one command. The buffer starts with GET_VARIABLES_HEADER, and
+// RequestCount requests and as many result records follow in this order. The
+// data of the variables follows the result records, each aligned to 8 bytes.
+//
+// Each result is what GetVariable returned for the request with the remaining
+// part of the buffer. DataOffset is the offset of the data from the start of
+// the buffer, and is valid only if Status is EFI_SUCCESS. On
+// EFI_BUFFER_TOO_SMALL, DataSize is the size required, and the following
+// requests are still processed. Pre- Get callbacks are invoked for each
+// request, and the request they deny fails with EFI_ACCESS_DENIED. Other
+// requests are logged and counted in the statistics, while Post- callbacks are
+// not invoked for them.
+//
+#define MAX_GET_VARIABLES_REQUESTS      64
+
+typedef struct _GET_VARIABLES_HEADER
+{
+    UINT32 RequestCount;        // [In]
+    UINT32 Reserved;
+} GET_VARIABLES_HEADER;
+
+typedef struct _GET_VARIABLES_REQUEST
+{
+    GUID VendorGuid;
+    CHAR16 VariableName[64];    // NULL-terminated
+} GET_VARIABLES_REQUEST;
+
+typedef struct _GET_VARIABLES_RESULT
+{
+    UINT64 Status;              // EFI_STATUS
+    UINT32 Attributes;
+    UINT32 DataSize;
+    UINT32 DataOffset;
+    UINT32 Reserved;
+} GET_VARIABLES_RESULT;
+
+//
+// The buffer for the SetWatchList command, which replaces the watch list. The
+// buffer is WATCH_LIST_HEADER followed by EntryCount entries. No entry clears
+// the watch list.
+//
+// SetVariable calls for a watched variable set the bit of the index of its
+// entry in the dirty bitmap and increment the generation, whether or not the
+// calls succeed. The new watch list starts with all bits set, so that the
+// caller reads all the variables once.
+//
+#define MAX_WATCH_ENTRIES               64
+
+typedef struct _WATCH_LIST_HEADER
+{
+    UINT32 EntryCount;
+    UINT32 Reserved;
+} WATCH_LIST_HEADER;
+
+typedef struct _WATCH_ENTRY
+{
+    GUID VendorGuid;
+    CHAR16 VariableName[64];    // NULL-terminated
+} WATCH_ENTRY;
+
+//
+// The buffer for the GetWatchState command. The dirty bitmap is cleared as it
+// is returned if GET_WATCH_STATE_FLAG_CLEAR is set. A caller polls Generation
+// and reads the variables of the returned bits only when it has changed.
+//
+#define GET_WATCH_STATE_FLAG_CLEAR      0x1
+
+typedef struct _GET_WATCH_STATE
+{
+    UINT32 Flags;               // [In]
+    UINT32 Generation;          // [Out]
+    UINT64 DirtyBitmap;         // [Out]
+    UINT32 EntryCount;          // [Out]
+    UINT32 Reserved;
+} GET_WATCH_STATE;
+
+//
+// The single log entry type in the log buffer. SequenceNumber is unique across
+// processors and gives the order in which entries were logged. VariableId is
+// resolved with the GetVariableNames command.
+//
+// Entries are variable-length. EntrySize includes Data and is a multiple of 8,
+// so that the next entry is naturally aligned as well.
+//
+#define LOG_ENTRY_FLAG_REDUNDANT_WRITE  0x1     // SetVariable wrote the current value
+#define LOG_ENTRY_FLAG_SHORT_CIRCUITED  0x2     // The original service was not called
+
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable: 4200)
+#endif
+typedef struct _VARIABLE_LOG_ENTRY
+{
+    UINT32 EntrySize;
+    UINT8 CallbackType;         // VARIABLE_CALLBACK_TYPE
+    UINT8 CaptureMode;          // CAPTURE_MODE of Data; never CaptureModeDefault
+    UINT16 Flags;               // LOG_ENTRY_FLAG_*
+    UINT32 ApicId;              // The processor that called the service
+    UINT32 VariableId;
+    UINT64 SequenceNumber;
+    UINT64 TscStart;            // The TSC value before calling the original service
+    UINT64 TscEnd;              // The TSC value after calling the original service
+    UINT64 Status;              // EFI_STATUS
+    UINT32 Attributes;
+    UINT32 DataSize;            // The size of the variable data
+    UINT32 CapturedSize;        // The size of Data
+    UINT32 SuppressedEntries;   // Calls of the variable not logged since the previous entry
+    UINT8 Data[0];
+} VARIABLE_LOG_ENTRY;
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+//
+// The parameter type of the Get/SetVariable service callback.
+//
+typedef struct _VARIABLE_CALLBACK_PARAMETERS
+{
+    VARIABLE_CALLBACK_TYPE CallbackType;
+    OPERATION_TYPE OperationType;
+    union
+    {
+        struct
+        {
+            CHAR16** VariableName;  // Mutable
+            GUID** VendorGuid;      // Mutable
+            UINT32** Attributes;    // Mutable; (*Attributes) may be NULL
+            UINTN** DataSize;       // Mutable
+            VOID** Data;            // Mutable; (*Data) may be NULL
+            BOOLEAN Succeeded;      // Immutable
+            EFI_STATUS Status;      // Immutable; valid only on Post-callback
+        } Get;
+
+        struct
+        {
+            CHAR16** VariableName;  // Mutable
+            GUID** VendorGuid;      // Mutable
+            UINT32* Attributes;     // Mutable
+            UINTN* DataSize;        // Mutable
+            VOID** Data;            // Mutable
+            BOOLEAN Succeeded;      // Immutable
+            EFI_STATUS Status;      // Immutable; valid only on Post-callback
+        } Set;
+    } Parameters;
+} VARIABLE_CALLBACK_PARAMETERS;
+
+//
+// Get/SetVariable service callback type.
+//
+// The callbacks are allowed to modify values pointed from Parameters if it is
+// indicated as mutable.
+//
+// Returning TRUE on Pre-callback prevent the service to be executed.
+// On Post-callback, the return value is ignored.
+//
+typedef
+BOOLEAN
+(EFIAPI*VARIABLE_CALLBACK) (
+    IN OUT VARIABLE_CALLBACK_PARAMETERS* Parameters
+    );
+
+//
+// The masks of VARIABLE_CALLBACK_SUBSCRIPTION. Bit N of CallbackTypeMask
+// selects VARIABLE_CALLBACK_TYPE N, and bit N of OperationTypeMask selects
+// OPERATION_TYPE N.
+//
+#define CALLBACK_TYPE_MASK_GET          (1 << VariableCallbackGet)
+#define CALLBACK_TYPE_MASK_SET          (1 << VariableCallbackSet)
+#define OPERATION_TYPE_MASK_PRE         (1 << OperationPre)
+#define OPERATION_TYPE_MASK_POST        (1 << OperationPost)
+
+//
+// The filters of VARIABLE_CALLBACK_SUBSCRIPTION.
+//
+#define SUBSCRIPTION_FILTER_VENDOR_GUID 0x1     // VendorGuid must match
+#define SUBSCRIPTION_FILTER_NAME_PREFIX 0x2     // VariableName must start with NamePrefix
+
+//
+// The flags of VARIABLE_CALLBACK_SUBSCRIPTION.
+//
+#define SUBSCRIPTION_FLAG_DEFERRED      0x1     // Post-calls are queued for DrainDeferredCallbacks
+
+//
+// The input of the RegisterCallbacks command. The command also accepts
+// VARIABLE_CALLBACK alone, which subscribes all Get/Set and Pre/Post calls.
+//
+// The filters are evaluated against the name and GUID at the time of each call,
+// that is, after modification by the preceding Pre-callbacks.
+//
+// The deferred callback must subscribe only Post-calls. It is never invoked by
+// this driver.
+//
+// Callbacks are invoked in ascending order of Priority, and in the order of
+// registration among the same priority. VARIABLE_CALLBACK alone registers the
+// callback with the priority 0.
+//
+typedef struct _VARIABLE_CALLBACK_SUBSCRIPTION
+{
+    VARIABLE_CALLBACK Callback;
+    UINT32 CallbackTypeMask;    // CALLBACK_TYPE_MASK_*
+    UINT32 OperationTypeMask;   // OPERATION_TYPE_MASK_*
+    UINT32 Filters;             // SUBSCRIPTION_FILTER_*
+    UINT32 Flags;               // SUBSCRIPTION_FLAG_*
+    UINT32 Priority;
+    GUID VendorGuid;
+    CHAR16 NamePrefix[32];      // NULL-terminated
+} VARIABLE_CALLBACK_SUBSCRIPTION;
+
+//
+// The buffer for the DrainDeferredCallbacks command. The buffer starts with
+// DRAIN_DEFERRED_CALLBACKS_HEADER, and the events queued for Callback follow,
+// oldest first. The events are removed from the queue as they are returned.
+//
+// Post-calls subscribed with SUBSCRIPTION_FLAG_DEFERRED are not delivered to
+// the callback inline. Instead, they are queued in the bounded queue of the
+// callback, and the caller of this command delivers them to its callback,
+// typically at PASSIVE_LEVEL. Events for the callback are dropped while its
+// queue is full, which does not affect other deferred callbacks. The name is
+// truncated to 63 characters, and the data to DEFERRED_CALLBACK_MAX_DATA_SIZE
+// bytes. The command fails with EFI_INVALID_PARAMETER if Callback is not
+// registered.
+//
+#define DEFERRED_CALLBACK_MAX_DATA_SIZE 256
+
+typedef struct _DEFERRED_CALLBACK_EVENT
+{
+    UINT64 Status;              // EFI_STATUS
+    UINT8 CallbackType;         // VARIABLE_CALLBACK_TYPE
+    UINT8 Reserved[3];
+    UINT32 Attributes;          // 0 if not returned by GetVariable
+    UINT32 DataSize;            // The size of the variable data
+    UINT32 CapturedSize;        // The size of Data
+    GUID VendorGuid;
+    CHAR16 VariableName[64];    // NULL-terminated
+    UINT8 Data[DEFERRED_CALLBACK_MAX_DATA_SIZE];
+} DEFERRED_CALLBACK_EVENT;
+
+typedef struct _DRAIN_DEFERRED_CALLBACKS_HEADER
+{
+    VARIABLE_CALLBACK Callback; // [In] The callback registered as deferred
+    UINT32 EventCount;          // [Out] The number of the events returned
+    UINT32 PendingEventCount;   // [Out] The number of the events left in the queue
+    UINT64 DroppedEvents;       // [Out] The number of the events ever dropped for Callback
+} DRAIN_DEFERRED_CALLBACKS_HEADER;
+
+#endif